@@ -0,0 +1,326 @@
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include "csapp.h"
+#include "log.h"
+#include "pool.h"
+#include "room.h"
+#include "worker_pool.h"
+#include "server.h"
+#include "admin.h"
+
+namespace {
+    const uint64_t SAMPLE_INTERVAL_NS = 1000000000;
+
+    // An admin client that does not read its snapshot is given up on
+    const int SEND_TIMEOUT_SECS = 1;
+
+    // How long an admin client has to send a command before it is
+    // simply sent the snapshot
+    const int COMMAND_WAIT_MS = 100;
+    const char RESET_COMMAND[] = "reset";
+
+    // Read the command an admin client sent, if any
+    std::string read_command(int csock) {
+        struct pollfd pfd = { csock, POLLIN, 0 };
+        char buf[64];
+        if (poll(&pfd, 1, COMMAND_WAIT_MS) <= 0) {
+            return "";
+        }
+        ssize_t n = recv(csock, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+        if (n <= 0) {
+            return "";
+        }
+        buf[n] = '\0';
+        return std::string(buf, strcspn(buf, "\r\n"));
+    }
+
+    uint64_t now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+    }
+
+    bool is_port(const std::string &address) {
+        return !address.empty() &&
+            std::all_of(address.begin(), address.end(), [](char c) { return isdigit(c); });
+    }
+
+    // A listening socket on the loopback interface only (the endpoint
+    // is for whoever runs the server, not for its clients)
+    int open_loopback_listenfd(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        int optval = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || ::listen(fd, LISTENQ) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // A listening Unix socket, replacing one left by an earlier run
+    int open_unix_listenfd(const std::string &path) {
+        struct sockaddr_un addr;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        unlink(path.c_str());
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || ::listen(fd, LISTENQ) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // What the rooms add up to
+    struct RoomTotals {
+        uint64_t rooms, members, dropped, disconnected;
+        std::vector<size_t> depths; // one per receiver queue
+        std::ostringstream lines;   // one per room
+
+        RoomTotals() : rooms(0), members(0), dropped(0), disconnected(0) { }
+    };
+
+    void add_room(const Room *room, void *arg) {
+        RoomTotals *totals = static_cast<RoomTotals *>(arg);
+        Room::Stats stats = room->get_stats();
+        size_t first = totals->depths.size();
+        room->get_queue_depths(totals->depths);
+
+        size_t queued = 0, max_queued = 0;
+        for (size_t i = first; i < totals->depths.size(); i++) {
+            queued += totals->depths[i];
+            max_queued = std::max(max_queued, totals->depths[i]);
+        }
+        totals->rooms++;
+        totals->members += stats.members;
+        totals->dropped += stats.dropped;
+        totals->disconnected += stats.disconnected;
+        totals->lines << "room " << room->get_room_name()
+                      << " members=" << stats.members
+                      << " receivers=" << totals->depths.size() - first
+                      << " queued=" << queued
+                      << " max_queued=" << max_queued
+                      << " dropped=" << stats.dropped
+                      << " disconnected=" << stats.disconnected << "\n";
+    }
+}
+
+AdminListener::AdminListener(Server *server, const std::string &address)
+  : m_server(server)
+  , m_address(address)
+  , m_fd(-1)
+  , m_wakefd(-1)
+  , m_started(false)
+  , m_prev()
+  , m_last()
+  , m_prev_ns(0)
+  , m_last_ns(0) {
+}
+
+// Stop the thread and close the socket
+AdminListener::~AdminListener() {
+    if (m_started) {
+        uint64_t one = 1;
+        ssize_t rc = write(m_wakefd, &one, sizeof(one));
+        (void) rc;
+        pthread_join(m_thread, nullptr);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+        if (!is_port(m_address)) {
+            unlink(m_address.c_str());
+        }
+    }
+    if (m_wakefd >= 0) {
+        close(m_wakefd);
+    }
+}
+
+bool AdminListener::start() {
+    m_fd = is_port(m_address) ? open_loopback_listenfd(std::stoi(m_address))
+                              : open_unix_listenfd(m_address);
+    m_wakefd = eventfd(0, EFD_CLOEXEC);
+    if (m_fd < 0 || m_wakefd < 0) {
+        return false;
+    }
+    m_last = metrics_get();
+    m_last_ns = now_ns();
+    m_prev = m_last;
+    m_prev_ns = m_last_ns;
+    if (pthread_create(&m_thread, nullptr, run, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    latency_set_enabled(true); // there is now somewhere to report it
+    return true;
+}
+
+void *AdminListener::run(void *arg) {
+    static_cast<AdminListener *>(arg)->loop();
+    return nullptr;
+}
+
+// Answer admin clients one at a time, sampling the counters in between
+void AdminListener::loop() {
+    struct pollfd fds[2];
+    fds[0].fd = m_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_wakefd;
+    fds[1].events = POLLIN;
+
+    while (true) {
+        uint64_t now = now_ns();
+        if (now - m_last_ns >= SAMPLE_INTERVAL_NS) {
+            sample();
+            now = m_last_ns;
+        }
+        int timeout_ms = (int) ((m_last_ns + SAMPLE_INTERVAL_NS - now) / 1000000) + 1;
+        if (poll(fds, 2, timeout_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("[admin] poll failed: %s\n", strerror(errno));
+            return;
+        }
+        if (fds[1].revents != 0) {
+            return; // the server is shutting down
+        }
+        if (fds[0].revents & POLLIN) {
+            int csock = accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (csock < 0) {
+                continue;
+            }
+            struct timeval timeout = { SEND_TIMEOUT_SECS, 0 };
+            setsockopt(csock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            std::string command = read_command(csock);
+            std::string snapshot = get_snapshot();
+            if (command == RESET_COMMAND) {
+                // The snapshot has what was measured up to the reset
+                latency_reset();
+            }
+            if (rio_writen(csock, snapshot.data(), snapshot.size()) < 0) {
+                LOG_DEBUG("[admin] Could not send a snapshot: %s\n", strerror(errno));
+            }
+            close(csock);
+        }
+    }
+}
+
+// Move the latest totals back and take new ones
+void AdminListener::sample() {
+    m_prev = m_last;
+    m_prev_ns = m_last_ns;
+    m_last = metrics_get();
+    m_last_ns = now_ns();
+}
+
+std::string AdminListener::get_snapshot() {
+    std::ostringstream out;
+
+    // Traffic, as totals and as rates over the last sampled second
+    MetricsTotals totals = metrics_get();
+    out << "connections_live "
+        << totals.counts[METRIC_CONNECTIONS_OPENED] - totals.counts[METRIC_CONNECTIONS_CLOSED] << "\n";
+    for (unsigned i = 0; i < NUM_METRICS; i++) {
+        out << METRIC_NAMES[i] << " " << totals.counts[i] << "\n";
+    }
+    double secs = m_last_ns > m_prev_ns ? (m_last_ns - m_prev_ns) / 1e9 : 1.0;
+    for (unsigned i = METRIC_MESSAGES_IN; i < NUM_METRICS; i++) {
+        out << METRIC_NAMES[i] << "_per_sec "
+            << (uint64_t) ((m_last.counts[i] - m_prev.counts[i]) / secs) << "\n";
+    }
+
+    // Delivery latency, in nanoseconds, since the last reset
+    LatencySummary latency[NUM_LATENCY_STAGES];
+    latency_get(latency);
+    for (unsigned i = 0; i < NUM_LATENCY_STAGES; i++) {
+        out << LATENCY_NAMES[i] << "_count " << latency[i].count << "\n"
+            << LATENCY_NAMES[i] << "_p50_ns " << latency[i].p50 << "\n"
+            << LATENCY_NAMES[i] << "_p99_ns " << latency[i].p99 << "\n"
+            << LATENCY_NAMES[i] << "_p999_ns " << latency[i].p999 << "\n"
+            << LATENCY_NAMES[i] << "_max_ns " << latency[i].max << "\n";
+    }
+
+    // Rooms and their members
+    RoomRegistry::Stats registry = m_server->get_room_stats();
+    out << "rooms_live " << registry.live << "\n"
+        << "rooms_created " << registry.created << "\n"
+        << "rooms_reclaimed " << registry.reclaimed << "\n";
+    RoomTotals rooms;
+    m_server->for_each_room(add_room, &rooms);
+    out << "room_members " << rooms.members << "\n"
+        << "slow_consumer_dropped " << rooms.dropped << "\n"
+        << "slow_consumer_disconnected " << rooms.disconnected << "\n";
+
+    // Receiver queue depths: how many queues hold at most 0, 1, 3,
+    // 7, ... deliveries (each count includes the ones before it)
+    std::vector<size_t> &depths = rooms.depths;
+    std::sort(depths.begin(), depths.end());
+    out << "queues " << depths.size() << "\n";
+    size_t counted = 0;
+    for (size_t bound = 0; counted < depths.size(); bound = bound * 2 + 1) {
+        while (counted < depths.size() && depths[counted] <= bound) {
+            counted++;
+        }
+        out << "queue_depth_le_" << bound << " " << counted << "\n";
+    }
+    if (!depths.empty()) {
+        out << "queue_depth_max " << depths.back() << "\n"
+            << "queue_depth_p50 " << depths[depths.size() / 2] << "\n"
+            << "queue_depth_p99 " << depths[depths.size() * 99 / 100] << "\n";
+    }
+
+    // Counters kept by the other parts of the server
+    WorkerPool::Stats pool;
+    if (m_server->get_worker_pool_stats(pool)) {
+        out << "workers_accepted " << pool.accepted << "\n"
+            << "workers_rejected " << pool.rejected << "\n"
+            << "workers_started " << pool.started << "\n"
+            << "workers_queued " << pool.queued << "\n"
+            << "workers_max_wait_ns " << pool.max_wait_ns << "\n";
+    }
+    RoomLogStore::Stats logs;
+    if (m_server->get_room_log_stats(logs)) {
+        out << "room_log_logs " << logs.logs << "\n"
+            << "room_log_records " << logs.records << "\n"
+            << "room_log_bytes " << logs.bytes << "\n"
+            << "room_log_commits " << logs.commits << "\n"
+            << "room_log_segments_created " << logs.segments_created << "\n"
+            << "room_log_segments_deleted " << logs.segments_deleted << "\n"
+            << "room_log_errors " << logs.errors << "\n"
+            << "room_log_disabled " << logs.disabled << "\n";
+    }
+    PoolStats blocks = pool_get_stats();
+    out << "pool_allocs " << blocks.allocs << "\n"
+        << "pool_reused " << blocks.reused << "\n"
+        << "pool_fresh " << blocks.fresh << "\n"
+        << "pool_large " << blocks.large << "\n"
+        << "pool_refills " << blocks.refills << "\n"
+        << "pool_spills " << blocks.spills << "\n"
+        << "log_dropped " << log_dropped() << "\n";
+
+    out << rooms.lines.str();
+    return out.str();
+}
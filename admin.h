@@ -0,0 +1,62 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <string>
+#include <cstdint>
+#include <pthread.h>
+#include "metrics.h"
+class Server;
+
+// The admin endpoint (server -M). A thread of its own listens on a
+// TCP port on the loopback interface, or on a Unix socket, and answers
+// every connection with a snapshot of the server's counters, one
+// "name value" line each, then closes it:
+//
+//   ./server -M 9000 5000 &  ...  nc localhost 9000
+//
+// A client that sends "reset" first is sent the snapshot, and then the
+// latency histograms are started over. Deliveries are only timed while
+// the endpoint is running.
+//
+// The snapshot covers connections, traffic (totals, and rates over the
+// last full second), delivery latency percentiles, rooms and their
+// members, the depths of receiver queues, and the counters kept by the
+// worker pool, the room logs, the logger and the allocator. Nothing on
+// the clients' paths waits for it: the traffic counters and latency
+// histograms are per thread (metrics.h), and rooms and queues are read
+// the way a broadcast reads them.
+class AdminListener {
+public:
+  // address is a port number, or else the path of a Unix socket
+  AdminListener(Server *server, const std::string &address);
+  ~AdminListener();
+
+  // Open the listening socket and start the thread
+  bool start();
+
+  // The text sent to an admin client
+  std::string get_snapshot();
+
+private:
+  // prohibit value semantics
+  AdminListener(const AdminListener &);
+  AdminListener &operator=(const AdminListener &);
+
+  static void *run(void *arg);
+  void loop();
+  void sample();
+
+  Server *m_server;
+  std::string m_address;
+  int m_fd;     // listening socket
+  int m_wakefd; // eventfd that tells the thread to stop
+  pthread_t m_thread;
+  bool m_started;
+
+  // Counter totals from the last two samples, taken about a second
+  // apart, for the rates (thread only)
+  MetricsTotals m_prev, m_last;
+  uint64_t m_prev_ns, m_last_ns;
+};
+
+#endif // ADMIN_H
@@ -0,0 +1,385 @@
+// Microbenchmarks of the core primitives, written as JSON so that the
+// results of two versions can be compared:
+//
+//   make bench                 (writes bench.json)
+//
+//   mqueue      1..N producer threads enqueue into one MessageQueue
+//               while a single consumer dequeues, the way broadcasting
+//               senders feed one receiver
+//   broadcast   Room::broadcast_message into rooms of 1 to 100k
+//               receivers (queues are drained between timed runs), and
+//               Room::add_member as the room grows to each size
+//   connection  Connection::send and receive over a socketpair, in
+//               each protocol, one message at a time and with
+//               send_batch of encoded Deliveries
+//
+// Every figure is the median of TRIALS runs. The MessageQueue is the
+// one the build selected (make MQUEUE=lockfree), and is named in the
+// output.
+//
+// Usage: bench_micro [output_file] [max_producers] [max_members]
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "message.h"
+#include "connection.h"
+#include "delivery.h"
+#include "message_queue.h"
+#include "room.h"
+#include "user.h"
+#include "log.h"
+
+namespace {
+  const int TRIALS = 3;
+
+  // Work done by each timed run
+  const long MQUEUE_MSGS_PER_PRODUCER = 200000;
+  const long BROADCAST_DELIVERIES = 1000000;
+  const long CONNECTION_MSGS = 200000;
+
+  // Queued deliveries allowed to pile up before the receivers' queues
+  // are drained (untimed)
+  const long BROADCAST_DRAIN_AT = 200000;
+
+  // Deliveries taken from a queue at once, as the event loop does
+  const size_t DEQUEUE_BATCH = 64;
+
+  // The text of every message (with its "room:sender:" prefix, as a
+  // delivery has it)
+  const char PAYLOAD[] = "bench:sender:"
+                         "the quick brown fox jumps over the lazy dog 0123456789abcdefghij";
+
+  double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  // Run a trial TRIALS times and return the median of its results
+  template<typename Trial>
+  double median_of_trials(Trial trial) {
+    std::vector<double> results;
+    for (int i = 0; i < TRIALS; i++) {
+      results.push_back(trial());
+    }
+    std::sort(results.begin(), results.end());
+    return results[TRIALS / 2];
+  }
+
+  // One JSON object per result, built up field by field
+  class JsonResult {
+  public:
+    JsonResult(const char *bench) { m_out << "{\"bench\": \"" << bench << "\""; }
+
+    JsonResult &add(const char *name, const std::string &value) {
+      m_out << ", \"" << name << "\": \"" << value << "\"";
+      return *this;
+    }
+    JsonResult &add(const char *name, long value) {
+      m_out << ", \"" << name << "\": " << value;
+      return *this;
+    }
+    JsonResult &add(const char *name, double value) {
+      m_out << ", \"" << name << "\": " << std::fixed << std::setprecision(1) << value;
+      return *this;
+    }
+
+    std::string str() const { return m_out.str() + "}"; }
+
+  private:
+    std::ostringstream m_out;
+  };
+
+  //
+  // MessageQueue
+  //
+
+  struct ProducerArgs {
+    MessageQueue *mqueue;
+    long count;
+  };
+
+  // Enqueue the same Delivery over and over, as a broadcast would
+  void *producer(void *arg) {
+    ProducerArgs *args = static_cast<ProducerArgs *>(arg);
+    Delivery *msg = Delivery::create(OP_DELIVERY, PAYLOAD);
+    for (long i = 0; i < args->count; i++) {
+      msg->ref();
+      args->mqueue->enqueue(msg);
+    }
+    msg->unref();
+    return nullptr;
+  }
+
+  // Messages per second through one queue
+  double mqueue_trial(int num_producers) {
+    MessageQueue mqueue;
+    ProducerArgs args = { &mqueue, MQUEUE_MSGS_PER_PRODUCER };
+    std::vector<pthread_t> threads(num_producers);
+
+    double start = now_sec();
+    for (int i = 0; i < num_producers; i++) {
+      pthread_create(&threads[i], nullptr, producer, &args);
+    }
+
+    // This thread is the consumer: wait for a message, then take
+    // whatever else is queued with it
+    long total = MQUEUE_MSGS_PER_PRODUCER * num_producers;
+    std::vector<Delivery *> batch;
+    for (long received = 0; received < total; ) {
+      Delivery *msg = mqueue.dequeue();
+      if (!msg) {
+        continue;
+      }
+      batch.assign(1, msg);
+      mqueue.dequeue_batch(batch, DEQUEUE_BATCH);
+      for (Delivery *taken : batch) {
+        taken->unref();
+      }
+      received += batch.size();
+    }
+    double elapsed = now_sec() - start;
+
+    for (int i = 0; i < num_producers; i++) {
+      pthread_join(threads[i], nullptr);
+    }
+    return total / elapsed;
+  }
+
+  void bench_mqueue(int max_producers, std::vector<std::string> &results) {
+    for (int producers = 1; producers <= max_producers; producers *= 2) {
+      double rate = median_of_trials([=]() { return mqueue_trial(producers); });
+      results.push_back(JsonResult("mqueue")
+                        .add("producers", (long) producers)
+                        .add("msgs_per_sec", (long) rate)
+                        .add("ns_per_msg", 1e9 / rate).str());
+      std::cerr << "mqueue producers=" << producers << " msgs/sec=" << (long) rate << "\n";
+    }
+  }
+
+  //
+  // Room::broadcast_message
+  //
+
+  void drain(std::vector<User *> &users) {
+    std::vector<Delivery *> batch;
+    for (User *user : users) {
+      batch.clear();
+      while (user->mqueue.dequeue_batch(batch, DEQUEUE_BATCH) > 0) {
+        for (Delivery *msg : batch) {
+          msg->unref();
+        }
+        batch.clear();
+      }
+    }
+  }
+
+  // Broadcasts per second into a room of users.size() receivers
+  double broadcast_trial(Room &room, std::vector<User *> &users) {
+    const std::string sender = "sender";
+    const StringView text("the quick brown fox jumps over the lazy dog 0123456789abcdefghij");
+    long members = users.size();
+    long broadcasts = std::max(BROADCAST_DELIVERIES / members, 10L);
+    long per_drain = std::max(BROADCAST_DRAIN_AT / members, 1L);
+
+    double elapsed = 0;
+    for (long done = 0; done < broadcasts; ) {
+      long count = std::min(per_drain, broadcasts - done);
+      double start = now_sec();
+      for (long i = 0; i < count; i++) {
+        room.broadcast_message(sender, text);
+      }
+      elapsed += now_sec() - start;
+      done += count;
+      drain(users);
+    }
+    return broadcasts / elapsed;
+  }
+
+  void bench_broadcast(long max_members, std::vector<std::string> &results) {
+    // Only the broadcast itself is measured, not its log message
+    int log_level = g_log_level.load();
+    log_set_level(LOG_LEVEL_WARN);
+
+    // One room grows through every size, so each member joins once
+    Room *room = new Room("bench");
+    std::vector<User *> users;
+    for (long members = 1; members <= max_members; members *= 10) {
+      long joined = members - users.size();
+      double start = now_sec();
+      while ((long) users.size() < members) {
+        User *user = new User("user" + std::to_string(users.size()));
+        room->add_member(user, &user->mqueue);
+        users.push_back(user);
+      }
+      double join_ns = (now_sec() - start) * 1e9 / joined;
+
+      double rate = median_of_trials([&]() { return broadcast_trial(*room, users); });
+      results.push_back(JsonResult("broadcast")
+                        .add("members", members)
+                        .add("broadcasts_per_sec", rate)
+                        .add("ns_per_broadcast", 1e9 / rate)
+                        .add("ns_per_delivery", 1e9 / rate / members)
+                        .add("ns_per_join", join_ns).str());
+      std::cerr << "broadcast members=" << members << " broadcasts/sec=" << (long) rate << "\n";
+    }
+
+    // (removing members one at a time would copy the list each time)
+    delete room;
+    for (User *user : users) {
+      delete user;
+    }
+    log_set_level(log_level);
+  }
+
+  //
+  // Connection
+  //
+
+  enum SendMode {
+    SEND_MESSAGE, // Connection::send of a Message, as clients send
+    SEND_BATCH,   // Connection::send_batch of Deliveries, as the server sends
+  };
+
+  struct ConnectionArgs {
+    int fd;
+    bool binary;
+    SendMode mode;
+    long count;
+  };
+
+  void *connection_sender(void *arg) {
+    ConnectionArgs *args = static_cast<ConnectionArgs *>(arg);
+    Connection conn(args->fd); // (closes the socket when done)
+    if (args->binary) {
+      conn.set_binary();
+    }
+
+    if (args->mode == SEND_MESSAGE) {
+      Message msg(OP_DELIVERY, PAYLOAD);
+      for (long i = 0; i < args->count; i++) {
+        if (!conn.send(msg)) {
+          break;
+        }
+      }
+    } else {
+      Delivery *msg = Delivery::create(OP_DELIVERY, PAYLOAD);
+      std::vector<Delivery *> batch(DEQUEUE_BATCH, msg);
+      for (long sent = 0; sent < args->count; sent += batch.size()) {
+        batch.resize(std::min((long) DEQUEUE_BATCH, args->count - sent));
+        if (!conn.send_batch(batch)) {
+          break;
+        }
+      }
+      msg->unref();
+    }
+    return nullptr;
+  }
+
+  // Messages per second sent by one thread and received by another
+  double connection_trial(bool binary, SendMode mode) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+      return 0;
+    }
+    ConnectionArgs args = { fds[0], binary, mode, CONNECTION_MSGS };
+    Connection conn(fds[1]);
+    if (binary) {
+      conn.set_binary();
+    }
+
+    double start = now_sec();
+    pthread_t thread;
+    pthread_create(&thread, nullptr, connection_sender, &args);
+    long received = 0;
+    MessageView msg;
+    while (received < CONNECTION_MSGS && conn.receive(msg)) {
+      received++;
+    }
+    double elapsed = now_sec() - start;
+    pthread_join(thread, nullptr);
+
+    if (received < CONNECTION_MSGS) {
+      std::cerr << "connection: only " << received << " messages arrived\n";
+    }
+    return received / elapsed;
+  }
+
+  void bench_connection(std::vector<std::string> &results) {
+    const struct {
+      const char *protocol;
+      const char *send;
+      bool binary;
+      SendMode mode;
+    } configs[] = {
+      { "text", "message", false, SEND_MESSAGE },
+      { "binary", "message", true, SEND_MESSAGE },
+      { "text", "batch", false, SEND_BATCH },
+      { "binary", "batch", true, SEND_BATCH },
+    };
+
+    Delivery *sample = Delivery::create(OP_DELIVERY, PAYLOAD);
+    for (const auto &config : configs) {
+      double rate = median_of_trials([&]() { return connection_trial(config.binary, config.mode); });
+      size_t wire_len = sample->get_wire_len(config.binary);
+      results.push_back(JsonResult("connection")
+                        .add("protocol", config.protocol)
+                        .add("send", config.send)
+                        .add("msgs_per_sec", (long) rate)
+                        .add("mb_per_sec", rate * wire_len / 1e6)
+                        .add("ns_per_msg", 1e9 / rate).str());
+      std::cerr << "connection protocol=" << config.protocol << " send=" << config.send
+                << " msgs/sec=" << (long) rate << "\n";
+    }
+    sample->unref();
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string output = argc > 1 ? argv[1] : "-";
+  int max_producers = argc > 2 ? std::stoi(argv[2]) : 8;
+  long max_members = argc > 3 ? std::stol(argv[3]) : 100000;
+
+#ifdef MQUEUE_LOCKFREE
+  const char *impl = "lockfree";
+#else
+  const char *impl = "locked";
+#endif
+
+  std::vector<std::string> results;
+  bench_mqueue(max_producers, results);
+  bench_broadcast(max_members, results);
+  bench_connection(results);
+
+  std::ostringstream json;
+  json << "{\n"
+       << "  \"mqueue_impl\": \"" << impl << "\",\n"
+       << "  \"cpus\": " << sysconf(_SC_NPROCESSORS_ONLN) << ",\n"
+       << "  \"trials\": " << TRIALS << ",\n"
+       << "  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    json << "    " << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  json << "  ]\n"
+       << "}\n";
+
+  if (output == "-") {
+    std::cout << json.str();
+  } else {
+    std::ofstream out(output);
+    if (!(out << json.str())) {
+      std::cerr << "Error: could not write " << output << "\n";
+      return 1;
+    }
+  }
+  return 0;
+}
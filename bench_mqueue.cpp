@@ -0,0 +1,88 @@
+// Contention benchmark for MessageQueue: several producer threads
+// enqueue into one queue while a single consumer dequeues, the way
+// broadcasting senders feed one receiver. The Makefile builds this
+// twice, once for each MessageQueue implementation:
+//
+//   make bench-mqueue
+//
+// Usage: bench_mqueue [messages_per_producer] [max_producers]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <pthread.h>
+#include "delivery.h"
+#include "message_queue.h"
+
+namespace {
+  struct ProducerArgs {
+    MessageQueue *mqueue;
+    long count;
+  };
+
+  // Current time on the monotonic clock, in seconds
+  double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  // Enqueue the same Delivery over and over, as a broadcast would
+  void *producer(void *arg) {
+    ProducerArgs *args = static_cast<ProducerArgs *>(arg);
+    Delivery *msg = Delivery::create(OP_DELIVERY, "room:sender:benchmark message");
+    for (long i = 0; i < args->count; i++) {
+      msg->ref();
+      args->mqueue->enqueue(msg);
+    }
+    msg->unref();
+    return nullptr;
+  }
+
+  // Run one trial and return the throughput in messages per second
+  double run_trial(int num_producers, long per_producer) {
+    MessageQueue mqueue;
+    ProducerArgs args = { &mqueue, per_producer };
+    std::vector<pthread_t> threads(num_producers);
+
+    double start = now_sec();
+    for (int i = 0; i < num_producers; i++) {
+      pthread_create(&threads[i], nullptr, producer, &args);
+    }
+
+    // This thread is the single consumer
+    long total = per_producer * num_producers;
+    for (long received = 0; received < total; ) {
+      Delivery *msg = mqueue.dequeue();
+      if (msg) {
+        msg->unref();
+        received++;
+      }
+    }
+    double elapsed = now_sec() - start;
+
+    for (int i = 0; i < num_producers; i++) {
+      pthread_join(threads[i], nullptr);
+    }
+    return total / elapsed;
+  }
+}
+
+int main(int argc, char **argv) {
+  long per_producer = argc > 1 ? std::stol(argv[1]) : 200000;
+  int max_producers = argc > 2 ? std::stoi(argv[2]) : 8;
+
+#ifdef MQUEUE_LOCKFREE
+  const char *impl = "lockfree";
+#else
+  const char *impl = "locked";
+#endif
+
+  for (int producers = 1; producers <= max_producers; producers *= 2) {
+    double rate = run_trial(producers, per_producer);
+    std::cout << impl << " producers=" << producers
+              << " msgs/sec=" << (long) rate << "\n";
+  }
+  return 0;
+}
@@ -0,0 +1,144 @@
+// Startup benchmark for durable mode: for a range of log sizes, it
+// writes that much to the room logs, then times what a restarted
+// server does before it can accept clients (RoomLogStore::start, which
+// finds every room's log) and what the first join of each room costs
+// (creating the Room refills its history from the log). For comparison
+// it also times reading every record back, which is what a recovery
+// that replayed the whole log would have to do.
+//
+// The segment files were just written, so they are read from the page
+// cache; a cold start would make the full scan much slower still.
+//
+//   make bench-recovery
+//
+// Usage: bench_recovery [max_megabytes] [num_rooms] [history_size]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "room.h"
+#include "room_log.h"
+
+namespace {
+  const size_t SEGMENT_SIZE = 16 << 20;
+  const size_t PAYLOAD_SIZE = 100;
+
+  double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  // Delete a directory tree of room logs (two levels deep)
+  void remove_logs(const std::string &path) {
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+      return;
+    }
+    while (struct dirent *entry = readdir(dir)) {
+      if (entry->d_name[0] == '.') {
+        continue;
+      }
+      std::string child = path + "/" + entry->d_name;
+      struct stat st;
+      if (stat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        remove_logs(child);
+      } else {
+        unlink(child.c_str());
+      }
+    }
+    closedir(dir);
+    rmdir(path.c_str());
+  }
+
+  RoomLogOptions make_options(const std::string &dir) {
+    RoomLogOptions options;
+    options.dir = dir;
+    options.segment_size = SEGMENT_SIZE;
+    return options;
+  }
+
+  void run_trial(const std::string &dir, size_t megabytes, int num_rooms, size_t history_size) {
+    remove_logs(dir);
+    std::vector<std::string> names;
+    for (int i = 0; i < num_rooms; i++) {
+      names.push_back("room" + std::to_string(i));
+    }
+
+    // Fill the logs, spreading the records over the rooms
+    size_t total = (megabytes << 20) / (PAYLOAD_SIZE + sizeof(RoomLogStore::RecordHeader));
+    double append_secs;
+    {
+      RoomLogStore store(make_options(dir));
+      store.start();
+      std::vector<RoomLog *> logs;
+      for (const std::string &name : names) {
+        logs.push_back(store.open(name));
+      }
+      std::string payload(PAYLOAD_SIZE, 'x');
+      double start = now_sec();
+      for (size_t i = 0; i < total; i++) {
+        RoomLog *log = logs[i % num_rooms];
+        log->append(log->get_next_seq(), payload.data(), payload.size());
+      }
+      append_secs = now_sec() - start;
+    } // the store commits everything as it is destroyed
+
+    // What a restarted server does before it accepts connections
+    double start = now_sec();
+    RoomLogStore store(make_options(dir));
+    store.start();
+    double startup_secs = now_sec() - start;
+
+    // The first join of every room
+    start = now_sec();
+    for (const std::string &name : names) {
+      Room room(name, history_size, store.open(name));
+    }
+    double join_secs = now_sec() - start;
+
+    // Reading every record back instead
+    start = now_sec();
+    size_t scanned = 0;
+    for (const std::string &name : names) {
+      std::vector<RoomLog::Record> records;
+      store.open(name)->read_records(1, records);
+      scanned += records.size();
+    }
+    double scan_secs = now_sec() - start;
+
+    std::cout << "log=" << megabytes << "MB records=" << total
+              << " appends/sec=" << (long) (total / append_secs)
+              << " startup=" << startup_secs * 1e3 << "ms"
+              << " first_joins=" << join_secs * 1e3 << "ms"
+              << " full_scan=" << scan_secs * 1e3 << "ms (" << scanned << " records)\n";
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t max_megabytes = argc > 1 ? std::stoul(argv[1]) : 512;
+  int num_rooms = argc > 2 ? std::stoi(argv[2]) : 16;
+  size_t history_size = argc > 3 ? std::stoul(argv[3]) : 1000;
+  log_set_level(LOG_LEVEL_WARN); // no "Recovered" messages between results
+
+  char dir_template[] = "/tmp/bench_recovery.XXXXXX";
+  if (!mkdtemp(dir_template)) {
+    std::cerr << "Could not create a directory for the logs\n";
+    return 1;
+  }
+  std::string dir = dir_template;
+
+  for (size_t megabytes = 1; megabytes <= max_megabytes; megabytes *= 4) {
+    run_trial(dir, megabytes, num_rooms, history_size);
+  }
+  remove_logs(dir);
+  return 0;
+}
@@ -0,0 +1,169 @@
+// Lookup benchmark for the room registry: several threads look up
+// (join) existing rooms at random, as clients do during a mass
+// reconnect. It compares RoomRegistry with the std::map under a single
+// mutex that the server used before, and prints a latency histogram
+// for each run.
+//
+//   make bench-rooms
+//
+// Usage: bench_rooms [lookups_per_thread] [max_threads] [num_rooms]
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <cstdint>
+#include <pthread.h>
+#include "guard.h"
+#include "room.h"
+#include "room_registry.h"
+
+namespace {
+  // Latency buckets are powers of two nanoseconds: bucket i counts
+  // lookups that took [2^i, 2^(i+1)) ns
+  const int NUM_BUCKETS = 32;
+
+  // The registry the server used before RoomRegistry
+  class MapRegistry {
+  public:
+    MapRegistry() { pthread_mutex_init(&m_lock, nullptr); }
+    ~MapRegistry() {
+      for (auto &entry : m_rooms) {
+        delete entry.second;
+      }
+      pthread_mutex_destroy(&m_lock);
+    }
+
+    Room *find_or_create(const std::string &room_name) {
+      Guard guard(m_lock);
+      Room *&room = m_rooms[room_name];
+      if (!room) {
+        room = new Room(room_name);
+      }
+      return room;
+    }
+
+    // Rooms were never freed
+    void release(Room *) { }
+
+  private:
+    std::map<std::string, Room *> m_rooms;
+    pthread_mutex_t m_lock;
+  };
+
+  template<typename Registry>
+  struct LookupArgs {
+    Registry *registry;
+    const std::vector<std::string> *names;
+    long count;
+    unsigned seed;
+    uint64_t histogram[NUM_BUCKETS];
+  };
+
+  uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  double now_sec() {
+    return now_ns() / 1e9;
+  }
+
+  int bucket_for(uint64_t ns) {
+    int bucket = 0;
+    while (ns > 1 && bucket < NUM_BUCKETS - 1) {
+      ns >>= 1;
+      bucket++;
+    }
+    return bucket;
+  }
+
+  // Time each lookup of a randomly chosen existing room
+  template<typename Registry>
+  void *lookup_thread(void *arg) {
+    LookupArgs<Registry> *args = static_cast<LookupArgs<Registry> *>(arg);
+    const std::vector<std::string> &names = *args->names;
+    for (long i = 0; i < args->count; i++) {
+      const std::string &name = names[rand_r(&args->seed) % names.size()];
+      uint64_t start = now_ns();
+      Room *room = args->registry->find_or_create(name);
+      uint64_t elapsed = now_ns() - start;
+      args->histogram[bucket_for(elapsed)]++;
+      args->registry->release(room);
+    }
+    return nullptr;
+  }
+
+  // Value below which the given fraction of lookups fell (the upper
+  // bound of its bucket)
+  uint64_t percentile(const uint64_t *histogram, uint64_t total, double fraction) {
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+      seen += histogram[i];
+      if (seen >= total * fraction) {
+        return 2ULL << i;
+      }
+    }
+    return 2ULL << (NUM_BUCKETS - 1);
+  }
+
+  template<typename Registry>
+  void run_trial(const char *impl, int num_threads, long per_thread,
+                 const std::vector<std::string> &names) {
+    // Every room keeps the reference taken here, so the lookups below
+    // never create or reclaim one
+    Registry registry;
+    for (const std::string &name : names) {
+      registry.find_or_create(name);
+    }
+
+    std::vector<LookupArgs<Registry>> args(num_threads);
+    std::vector<pthread_t> threads(num_threads);
+    double start = now_sec();
+    for (int i = 0; i < num_threads; i++) {
+      args[i] = LookupArgs<Registry>{ &registry, &names, per_thread, (unsigned) i + 1, {} };
+      pthread_create(&threads[i], nullptr, lookup_thread<Registry>, &args[i]);
+    }
+
+    uint64_t histogram[NUM_BUCKETS] = {};
+    for (int i = 0; i < num_threads; i++) {
+      pthread_join(threads[i], nullptr);
+      for (int b = 0; b < NUM_BUCKETS; b++) {
+        histogram[b] += args[i].histogram[b];
+      }
+    }
+    double elapsed = now_sec() - start;
+
+    uint64_t total = per_thread * num_threads;
+    std::cout << impl << " threads=" << num_threads
+              << " lookups/sec=" << (long) (total / elapsed)
+              << " p50<=" << percentile(histogram, total, 0.5) << "ns"
+              << " p99<=" << percentile(histogram, total, 0.99) << "ns"
+              << " p999<=" << percentile(histogram, total, 0.999) << "ns\n";
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+      if (histogram[b]) {
+        std::cout << "  [" << (1ULL << b) << "ns, " << (2ULL << b) << "ns) "
+                  << histogram[b] << "\n";
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  long per_thread = argc > 1 ? std::stol(argv[1]) : 500000;
+  int max_threads = argc > 2 ? std::stoi(argv[2]) : 8;
+  int num_rooms = argc > 3 ? std::stoi(argv[3]) : 10000;
+
+  std::vector<std::string> names;
+  for (int i = 0; i < num_rooms; i++) {
+    names.push_back("room" + std::to_string(i));
+  }
+
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    run_trial<MapRegistry>("map", threads, per_thread, names);
+    run_trial<RoomRegistry>("registry", threads, per_thread, names);
+  }
+  return 0;
+}
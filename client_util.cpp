@@ -22,3 +22,9 @@ std::string rtrim(const std::string &s) {
 std::string trim(const std::string &s) {
   return rtrim(ltrim(s));
 }
+
+bool binary_protocol_accepted(const Message &reply) {
+  const std::string accepted(PROTO_V2_ACCEPTED);
+  return reply.op == OP_OK && reply.data.size() >= accepted.size() &&
+    reply.data.compare(reply.data.size() - accepted.size(), accepted.size(), accepted) == 0;
+}
@@ -14,4 +14,8 @@ std::string trim(const std::string &s);
 
 // you can add additional declarations here...
 
+// True if the server's reply to a login that asked for the binary
+// protocol (see message.h) says it agreed to use it
+bool binary_protocol_accepted(const Message &reply);
+
 #endif // CLIENT_UTIL_H
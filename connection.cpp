@@ -1,49 +1,64 @@
 #include <sstream>
 #include <cctype>
 #include <cassert>
+#include <cstring>
 #include "csapp.h"
 #include "message.h"
+#include "delivery.h"
+#include "metrics.h"
 #include "connection.h"
 
 
 Connection::Connection()
   : m_fd(-1)                // no active connection
+  , m_nonblocking(false)
+  , m_binary(false)
+  , m_buffered(false)
+  , m_inpos(0)
+  , m_inend(0)
+  , m_read_ns(0)
+  , m_eof(false)
+  , m_outpos(0)
   , m_last_result(SUCCESS) { //last operation was successful
 }
 
 
 Connection::Connection(int fd)
-  : m_fd(fd)                
-  , m_last_result(SUCCESS) { 
-
-  // Initialize the rio_t object for buffered reading
-  rio_readinitb(&m_fdbuf, m_fd);
+  : m_fd(fd)
+  , m_nonblocking(false)
+  , m_binary(false)
+  , m_buffered(false)
+  , m_inpos(0)              // input buffer starts out empty
+  , m_inend(0)
+  , m_read_ns(0)
+  , m_eof(false)
+  , m_outpos(0)
+  , m_last_result(SUCCESS) {
 }
 
 // Establish connection to server at specified hostname and port
 void Connection::connect(const std::string &hostname, int port) {
   // Convert port to string for open_clientfd function
   std::string port_str = std::to_string(port);
-  
+
   // Open connection to server using CSAPP's helper function
   m_fd = open_clientfd(hostname.c_str(), port_str.c_str());
-  
+
   // Check if connection failed
   if (m_fd < 0) {
     m_last_result = INVALID_MSG;
     return;
   }
-  
-  // Initialize the rio_t object for buffered reading on new connection
-  rio_readinitb(&m_fdbuf, m_fd);
+
+  // Discard anything buffered from a previous connection
+  m_inpos = m_inend = 0;
+  m_eof = false;
 }
 
 // ensures connection is properly closed
 Connection::~Connection() {
   // Close the socket if it is currently open
-  if (is_open()) {
-    Close(m_fd);
-  }
+  close();
 }
 
 // Check if connection is currently active
@@ -54,9 +69,146 @@ bool Connection::is_open() const {
 // Close the connection if it's open
 void Connection::close() {
   if (is_open()) {
-    Close(m_fd);  
-    m_fd = -1;    
+    // Buffered output (such as a final reply) still goes out; a
+    // non-blocking socket gets one more chance to take it
+    flush();
+    Close(m_fd);
+    m_fd = -1;
+  }
+}
+
+// Switch the socket to non-blocking mode
+bool Connection::set_nonblocking() {
+  int flags = fcntl(m_fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(m_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return false;
   }
+  m_nonblocking = true;
+  return true;
+}
+
+// Write pending output until it is gone or the socket is full
+bool Connection::flush(bool more) {
+  int flags = more ? MSG_MORE : 0;
+  while (m_outpos < m_outbuf.size()) {
+    ssize_t n = ::send(m_fd, m_outbuf.data() + m_outpos, m_outbuf.size() - m_outpos, flags);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true; // try again when the socket is writable
+      }
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+    m_outpos += n;
+    metrics_add(METRIC_BYTES_OUT, n);
+  }
+
+  // Everything was written, reuse the buffer from the start
+  m_outbuf.clear();
+  m_outpos = 0;
+  return true;
+}
+
+// Send a batch of Deliveries using writev
+bool Connection::send_batch(const std::vector<Delivery *> &batch) {
+  if (!is_open()) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+
+  struct iovec iov[IOV_BATCH];
+  for (size_t i = 0; i < batch.size(); i += IOV_BATCH) {
+    int iovcnt = 0;
+    for (size_t j = i; j < batch.size() && iovcnt < IOV_BATCH; j++, iovcnt++) {
+      iov[iovcnt].iov_base = const_cast<char *>(batch[j]->get_wire(m_binary));
+      iov[iovcnt].iov_len = batch[j]->get_wire_len(m_binary);
+    }
+    if (!write_iov(iov, iovcnt)) {
+      m_last_result = EOF_OR_ERROR;
+      return false;
+    }
+  }
+
+  metrics_add(METRIC_MESSAGES_OUT, batch.size());
+  m_last_result = SUCCESS;
+  return true;
+}
+
+// Throw away available input, noticing EOF
+bool Connection::discard_input() {
+  m_inpos = m_inend = 0;
+  while (true) {
+    ssize_t n = recv(m_fd, m_inbuf, INBUF_SIZE, MSG_DONTWAIT);
+    if (n > 0) {
+      metrics_add(METRIC_BYTES_IN, n);
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true; // nothing more for now, still connected
+    }
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+}
+
+// Write bytes to the socket (blocking), or queue them (non-blocking)
+bool Connection::write_bytes(const char *buf, size_t len) {
+  struct iovec iov;
+  iov.iov_base = const_cast<char *>(buf);
+  iov.iov_len = len;
+  return write_iov(&iov, 1);
+}
+
+// Write a gather list to the socket (blocking), or queue whatever the
+// socket will not take right now (non-blocking). The iovec array is
+// used as scratch space.
+bool Connection::write_iov(struct iovec *iov, int iovcnt) {
+  // Buffered: copy into the output buffer, writing it once it is full
+  if (m_buffered) {
+    for (int i = 0; i < iovcnt; i++) {
+      m_outbuf.append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+    }
+    return pending_output() < OUTBUF_FLUSH || flush(true);
+  }
+
+  // Preserve ordering: only write directly if nothing is queued
+  while (iovcnt > 0 && pending_output() == 0) {
+    ssize_t n = ::writev(m_fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (m_nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      return false;
+    }
+    metrics_add(METRIC_BYTES_OUT, n);
+
+    // Skip over the buffers that were written completely...
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    // ...and the written part of the next one
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  // Whatever the socket did not take is written by flush later
+  for (int i = 0; i < iovcnt; i++) {
+    m_outbuf.append(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+  }
+  return true;
 }
 
 // Send a Message object over the connection
@@ -67,64 +219,211 @@ bool Connection::send(const Message &msg) {
     return false;
   }
 
-  // Format the message according to protocol: "tag:data\n"
-  std::string formatted_msg = msg.tag + ":" + msg.data + "\n";
+  std::string formatted_msg;
+  if (m_binary) {
+    // Binary protocol: frame header, then the data
+    if (!is_opcode(msg.op) || msg.data.size() > MAX_FRAME_DATA) {
+      m_last_result = INVALID_MSG;
+      return false;
+    }
+    formatted_msg.reserve(FRAME_HEADER_LEN + msg.data.size());
+    formatted_msg += (char) msg.op;
+    formatted_msg += (char) 0; // flags
+    formatted_msg += (char) (msg.data.size() >> 8);
+    formatted_msg += (char) (msg.data.size() & 0xff);
+    formatted_msg += msg.data;
+  } else {
+    // Format the message according to protocol: "tag:data\n"
+    if (msg.op == OP_NONE) {
+      m_last_result = INVALID_MSG;
+      return false;
+    }
+    const OpcodeTag &tag = opcode_tag(msg.op);
+    formatted_msg.reserve(tag.len + msg.data.size() + 2);
+    formatted_msg.append(tag.str, tag.len);
+    formatted_msg += ':';
+    formatted_msg += msg.data;
+    formatted_msg += '\n';
+  }
 
-  // Send the complete message using reliable write
-  ssize_t bytes_sent = rio_writen(m_fd, formatted_msg.c_str(), formatted_msg.size());
-  
-  // Verify entire message was sent
-  if (bytes_sent != (ssize_t)formatted_msg.size()) {
+  // Send the complete message
+  if (!write_bytes(formatted_msg.c_str(), formatted_msg.size())) {
     m_last_result = EOF_OR_ERROR;
     return false;
   }
 
+  metrics_add(METRIC_MESSAGES_OUT);
   m_last_result = SUCCESS;
   return true;
 }
 
+// Send a Delivery, which is already encoded
+bool Connection::send(const Delivery &delivery) {
+  if (!is_open()) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+
+  if (!write_bytes(delivery.get_wire(m_binary), delivery.get_wire_len(m_binary))) {
+    m_last_result = EOF_OR_ERROR;
+    return false;
+  }
+
+  metrics_add(METRIC_MESSAGES_OUT);
+  m_last_result = SUCCESS;
+  return true;
+}
+
+// Read more data from the socket into the input buffer.
+// Returns false on EOF, error, or (non-blocking) no data available;
+// m_last_result says which.
+bool Connection::fill_inbuf() {
+  // About to wait for the peer: send whatever it may be waiting for
+  if (!m_nonblocking && pending_output() > 0 && !flush()) {
+    return false;
+  }
+
+  // Move the unparsed bytes to the front to make room
+  if (m_inpos > 0) {
+    memmove(m_inbuf, m_inbuf + m_inpos, m_inend - m_inpos);
+    m_inend -= m_inpos;
+    m_inpos = 0;
+  }
+
+  while (true) {
+    ssize_t n = ::read(m_fd, m_inbuf + m_inend, INBUF_SIZE - m_inend);
+    if (n > 0) {
+      m_inend += n;
+      m_read_ns = latency_stamp();
+      metrics_add(METRIC_BYTES_IN, n);
+      return true;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      m_last_result = WOULD_BLOCK;
+    } else {
+      m_last_result = EOF_OR_ERROR;
+      m_eof = (n == 0);
+    }
+    return false;
+  }
+}
+
 // Receive message from the connection
 bool Connection::receive(Message &msg) {
+  MessageView view;
+  if (!receive(view)) {
+    return false;
+  }
+
+  // Copy the data out of the input buffer
+  msg.op = view.op;
+  msg.data.assign(view.data.data(), view.data.size());
+  return true;
+}
+
+// Receive a message in place in the input buffer
+bool Connection::receive(MessageView &msg) {
   // Check if connection is valid
   if (!is_open()) {
     m_last_result = EOF_OR_ERROR;
     return false;
   }
 
-  // Buffer for reading the message (plus null terminator)
-  char buf[Message::MAX_LEN + 1];
-  
-  // Read a line using buffered I/O
-  ssize_t bytes_read = rio_readlineb(&m_fdbuf, buf, sizeof(buf));
-  
-  // Check for read errors or EOF
-  if (bytes_read <= 0) {
-    m_last_result = EOF_OR_ERROR;
+  if (!(m_binary ? receive_frame(msg) : receive_line(msg))) {
+    return false;
+  }
+  // (more input is only read when no complete message is buffered, so
+  // the latest read is the one that completed this message)
+  msg.received_ns = m_read_ns;
+  metrics_add(METRIC_MESSAGES_IN);
+  return true;
+}
+
+// Receive a binary (v2) frame
+bool Connection::receive_frame(MessageView &msg) {
+  // Wait until the header and all of the data are buffered
+  const unsigned char *header;
+  size_t len;
+  while (true) {
+    size_t avail = m_inend - m_inpos;
+    header = reinterpret_cast<const unsigned char *>(m_inbuf + m_inpos);
+    if (avail >= FRAME_HEADER_LEN) {
+      len = (header[2] << 8) | header[3];
+      if (len > MAX_FRAME_DATA) {
+        // There is no way to find the next frame
+        m_last_result = INVALID_MSG;
+        return false;
+      }
+      if (avail >= FRAME_HEADER_LEN + len) {
+        break;
+      }
+    }
+    if (!fill_inbuf()) {
+      return false;
+    }
+  }
+  m_inpos += FRAME_HEADER_LEN + len;
+
+  if (!is_opcode(header[0])) {
+    m_last_result = INVALID_MSG;
     return false;
   }
+  msg.op = Opcode(header[0]);
+  msg.data = StringView(reinterpret_cast<const char *>(header) + FRAME_HEADER_LEN, len);
 
-  // Remove trailing newline if present
-  if (buf[bytes_read - 1] == '\n') {
-    buf[bytes_read - 1] = '\0';
-    bytes_read--;
+  m_last_result = SUCCESS;
+  return true;
+}
+
+// Receive a "tag:data\n" line
+bool Connection::receive_line(MessageView &msg) {
+  // Find a complete line in the buffered input, reading more as needed.
+  // A line longer than MAX_LEN is split, just like rio_readlineb would.
+  const char *line = nullptr;
+  size_t len = 0;
+  while (line == nullptr) {
+    size_t avail = m_inend - m_inpos;
+    size_t limit = avail < Message::MAX_LEN ? avail : Message::MAX_LEN;
+    const char *start = m_inbuf + m_inpos;
+    const char *nl = static_cast<const char *>(memchr(start, '\n', limit));
+
+    if (nl != nullptr) {
+      line = start;
+      len = nl - start;
+      m_inpos += len + 1;
+    } else if (avail >= Message::MAX_LEN) {
+      line = start;
+      len = Message::MAX_LEN;
+      m_inpos += len;
+    } else if (!fill_inbuf()) {
+      // Check for read errors or EOF (or no data on a non-blocking
+      // socket). At EOF the rest of the input is the last line, even
+      // without a '\n', just like rio_readlineb would return it.
+      if (!m_eof || m_inend == m_inpos) {
+        return false;
+      }
+      line = m_inbuf + m_inpos; // (fill_inbuf may have moved it)
+      len = m_inend - m_inpos;
+      m_inpos = m_inend;
+    }
   }
 
-  // Convert buffer to string for parsing
-  std::string received_msg(buf);
-  
   // Find the colon separator between tag and data
-  size_t colon_pos = received_msg.find(':');
-  
+  const char *colon = static_cast<const char *>(memchr(line, ':', len));
+
   // Validate message format
-  if (colon_pos == std::string::npos) {
+  if (colon == nullptr) {
     m_last_result = INVALID_MSG;
     return false;
   }
 
-  // Extract tag (before colon) and data (after colon)
-  msg.tag = received_msg.substr(0, colon_pos);
-  msg.data = received_msg.substr(colon_pos + 1);
+  // Tag is before the colon (interned here), data after it
+  msg.op = tag_to_opcode(line, colon - line);
+  msg.data = StringView(colon + 1, line + len - (colon + 1));
 
   m_last_result = SUCCESS;
   return true;
-}
\ No newline at end of file
+}
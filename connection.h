@@ -1,8 +1,13 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <string>
+#include <vector>
+#include <sys/uio.h>
 #include "csapp.h"
 struct Message;
+struct MessageView;
+class Delivery;
 
 class Connection {
 public:
@@ -12,6 +17,7 @@ public:
     SUCCESS,      // send or receive was successful
     EOF_OR_ERROR, // EOF or error receiving or sending data
     INVALID_MSG,  // message format was invalid
+    WOULD_BLOCK,  // non-blocking socket has no complete message yet
   };
 
   // Default constructor: Connection starts out as not connected,
@@ -34,6 +40,38 @@ public:
 
   void close();
 
+  // Put the socket into non-blocking mode (used by the event loop).
+  // In this mode receive fails with WOULD_BLOCK when no complete
+  // message is buffered, and send queues whatever the socket could
+  // not take immediately so that flush can write it later.
+  bool set_nonblocking();
+
+  // Keep sent messages in the output buffer instead of writing each
+  // one straight away. The buffer is written by flush, when it reaches
+  // OUTBUF_FLUSH bytes, and (in blocking mode) before receive waits for
+  // input, so a reply is never held back while the peer waits for it.
+  void set_buffered() { m_buffered = true; }
+
+  // Write as much pending output as the socket will accept.
+  // With more set, the kernel is told more data follows (MSG_MORE) so
+  // it can fill whole segments; a final flush should leave it unset.
+  // Returns false only if the connection failed.
+  bool flush(bool more = false);
+
+  // Read and throw away whatever input is available without blocking.
+  // Returns false if the peer has closed the connection (or it failed).
+  bool discard_input();
+
+  // Number of bytes queued by send that have not been written yet
+  size_t pending_output() const { return m_outbuf.size() - m_outpos; }
+
+  int get_fd() const { return m_fd; }
+
+  // Switch to the binary (v2) framing described in message.h for every
+  // message sent or received from now on
+  void set_binary() { m_binary = true; }
+  bool is_binary() const { return m_binary; }
+
   // send and receive should set m_last_result to indicate
   // whether the most recent send or receive was successful,
   // and if not, whether the reason was an I/O error or reaching EOF,
@@ -41,6 +79,17 @@ public:
   bool send(const Message &msg);
   bool receive(Message &msg);
 
+  // Receive without copying: msg points into the input buffer and is
+  // only valid until the next call to receive
+  bool receive(MessageView &msg);
+
+  // Send a Delivery using its pre-encoded bytes
+  bool send(const Delivery &delivery);
+
+  // Send several Deliveries with as few system calls as possible
+  // (a single writev for up to IOV_BATCH messages)
+  bool send_batch(const std::vector<Delivery *> &batch);
+
   Result get_last_result() const { return m_last_result; }
 
 private:
@@ -48,10 +97,34 @@ private:
   Connection(const Connection &);
   Connection &operator=(const Connection &);
 
-  // these are the recommended member variables for the
-  // Connection class
+  // size of the input buffer (enough for many maximum-length messages)
+  static const unsigned INBUF_SIZE = 8192;
+
+  // most buffers handed to a single writev by send_batch
+  static const int IOV_BATCH = 64;
+
+  // buffered output is written once it reaches this many bytes
+  static const size_t OUTBUF_FLUSH = 16384;
+
+  bool write_bytes(const char *buf, size_t len);
+  bool write_iov(struct iovec *iov, int iovcnt);
+  bool fill_inbuf();
+  bool receive_line(MessageView &msg);
+  bool receive_frame(MessageView &msg);
+
   int m_fd;
-  rio_t m_fdbuf; // used to allow buffered input
+  bool m_nonblocking;
+  bool m_binary;
+  bool m_buffered;
+  // buffered input: unparsed bytes are m_inbuf[m_inpos..m_inend)
+  char m_inbuf[INBUF_SIZE];
+  size_t m_inpos, m_inend;
+  uint64_t m_read_ns; // when input was last read from the socket
+  bool m_eof;         // the last read found EOF (not an error)
+  // output not written yet: buffered by send (see set_buffered), or
+  // not accepted by a non-blocking socket
+  std::string m_outbuf;
+  size_t m_outpos;
   Result m_last_result;
 };
 
@@ -0,0 +1,57 @@
+#include <new>
+#include "message.h"
+#include "pool.h"
+#include "delivery.h"
+
+// Private constructor: encode the message once for each protocol,
+// both in the buffer that follows the object
+Delivery::Delivery(Opcode op, const StringView *parts, size_t num_parts, size_t data_len)
+  : m_refs(1)
+  , m_ingress_ns(0)
+  , m_tag_len(opcode_tag(op).len)
+  , m_text_len(m_tag_len + data_len + 2)
+  , m_wire_len(m_text_len + FRAME_HEADER_LEN + data_len) {
+  char *text = wire();
+  memcpy(text, opcode_tag(op).str, m_tag_len);
+  text += m_tag_len;
+  *text++ = ':';
+  char *data = text;
+  for (size_t i = 0; i < num_parts; i++) {
+    memcpy(text, parts[i].data(), parts[i].size());
+    text += parts[i].size();
+  }
+  *text++ = '\n';
+
+  char *frame = text;
+  frame[0] = (char) op;
+  frame[1] = (char) 0; // flags
+  frame[2] = (char) (data_len >> 8);
+  frame[3] = (char) (data_len & 0xff);
+  memcpy(frame + FRAME_HEADER_LEN, data, data_len);
+}
+
+// Create a new Delivery holding a single reference
+Delivery *Delivery::create(Opcode op, const std::string &data) {
+  StringView part(data);
+  return create(op, &part, 1);
+}
+
+Delivery *Delivery::create(Opcode op, const StringView *parts, size_t num_parts) {
+  size_t data_len = 0;
+  for (size_t i = 0; i < num_parts; i++) {
+    data_len += parts[i].size();
+  }
+  size_t wire_len = (opcode_tag(op).len + data_len + 2) + FRAME_HEADER_LEN + data_len;
+  void *block = pool_alloc(sizeof(Delivery) + wire_len);
+  return new (block) Delivery(op, parts, num_parts, data_len);
+}
+
+// Drop a reference, freeing the Delivery when it was the last one
+void Delivery::unref() {
+  // acq_rel so that whoever frees it sees every other holder's accesses
+  if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    size_t size = sizeof(Delivery) + m_wire_len;
+    this->~Delivery();
+    pool_free(this, size);
+  }
+}
@@ -0,0 +1,69 @@
+#ifndef DELIVERY_H
+#define DELIVERY_H
+
+#include <string>
+#include <atomic>
+#include "message.h"
+
+// An immutable, reference-counted message waiting to be delivered to
+// receivers. A broadcast creates one Delivery and every member's
+// MessageQueue holds a reference to it, so the payload is formatted
+// and encoded exactly once no matter how many receivers there are.
+// The object and its encoded bytes are a single allocation from the
+// thread-caching pool.
+class Delivery {
+public:
+  // Create a Delivery with one reference, owned by the caller
+  static Delivery *create(Opcode op, const std::string &data);
+
+  // The same, with the data given as pieces to be joined together
+  // (such as "room", ":", "sender", ":", "text")
+  static Delivery *create(Opcode op, const StringView *parts, size_t num_parts);
+
+  // Take another reference (e.g., for each queue it is placed in)
+  void ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+
+  // Drop a reference; the last one frees the Delivery
+  void unref();
+
+  // The encoded message as written to the socket: "tag:data\n" for
+  // the text protocol, or a frame for the binary protocol (message.h)
+  const char *get_wire(bool binary) const {
+    return binary ? wire() + m_text_len : wire();
+  }
+  size_t get_wire_len(bool binary) const {
+    return binary ? m_wire_len - m_text_len : m_text_len;
+  }
+
+  Opcode get_op() const { return Opcode(wire()[m_text_len]); }
+  std::string get_data() const { return get_data_view().str(); }
+
+  // When the message it carries was read from the sender's socket
+  // (latency_stamp), or 0 if not timed; set before it is shared
+  uint64_t get_ingress_ns() const { return m_ingress_ns; }
+  void set_ingress_ns(uint64_t ns) { m_ingress_ns = ns; }
+  StringView get_data_view() const {
+    return StringView(wire() + m_tag_len + 1, m_text_len - m_tag_len - 2);
+  }
+
+private:
+  Delivery(Opcode op, const StringView *parts, size_t num_parts, size_t data_len);
+  ~Delivery() { }
+
+  // prohibit value semantics
+  Delivery(const Delivery &);
+  Delivery &operator=(const Delivery &);
+
+  // The encoded bytes are stored right after the object, in the same
+  // block from the pool (see pool.h)
+  const char *wire() const { return reinterpret_cast<const char *>(this + 1); }
+  char *wire() { return reinterpret_cast<char *>(this + 1); }
+
+  std::atomic<int> m_refs;
+  uint64_t m_ingress_ns;
+  size_t m_tag_len;
+  size_t m_text_len;   // the text encoding is followed by the frame
+  size_t m_wire_len;
+};
+
+#endif // DELIVERY_H
@@ -0,0 +1,477 @@
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "message.h"
+#include "delivery.h"
+#include "message_queue.h"
+#include "connection.h"
+#include "guard.h"
+#include "session.h"
+#include "room.h"
+#include "metrics.h"
+#include "event_loop.h"
+
+namespace {
+    // epoll data value reserved for the wakeup eventfd
+    // (client ids start at 1)
+    const uint64_t WAKEUP_ID = 0;
+
+    // Stop reading commands / dequeuing deliveries for a client once
+    // this much output is waiting for its socket to become writable
+    const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+
+    // Maximum number of events handled per epoll_wait call
+    const int MAX_EVENTS = 256;
+
+    // Most deliveries moved from a queue to a socket in one send_batch
+    const size_t DELIVERY_BATCH = 256;
+}
+
+// Per-client state machine run by the loop
+struct EventLoop::Client {
+    enum State {
+        AWAIT_LOGIN, // waiting for slogin/rlogin
+        SENDER,      // logged in as a sender, handling commands
+        AWAIT_JOIN,  // logged in as a receiver, waiting for join
+        RECEIVER,    // receiver in a room, streaming deliveries
+    };
+
+    uint64_t id;
+    State state;
+    ClientInfo* info;
+    bool closing; // close as soon as the pending output is written
+};
+
+// EventLoop constructor
+EventLoop::EventLoop(Server *server)
+  : m_server(server)
+  , m_epfd(-1)
+  , m_wakefd(-1)
+  , m_started(false)
+  , m_stopping(false)
+  , m_next_id(1) {
+    pthread_mutex_init(&m_lock, nullptr);
+}
+
+// EventLoop destructor: stop the loop thread and drop its clients
+EventLoop::~EventLoop() {
+    if (m_started) {
+        {
+            Guard guard(m_lock);
+            m_stopping = true;
+        }
+        uint64_t one = 1;
+        ssize_t rc = write(m_wakefd, &one, sizeof(one));
+        (void) rc;
+        pthread_join(m_thread, nullptr);
+    }
+
+    for (auto &entry : m_clients) {
+        session_cleanup(entry.second->info);
+        delete entry.second;
+    }
+    for (int csock : m_new_clients) {
+        close(csock);
+    }
+    if (m_wakefd >= 0) {
+        close(m_wakefd);
+    }
+    if (m_epfd >= 0) {
+        close(m_epfd);
+    }
+    pthread_mutex_destroy(&m_lock);
+}
+
+// Set up epoll and the wakeup eventfd, then start the loop thread
+bool EventLoop::start() {
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epfd < 0 || m_wakefd < 0) {
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = WAKEUP_ID;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakefd, &ev) < 0) {
+        return false;
+    }
+
+    if (pthread_create(&m_thread, nullptr, run, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+// Queue an accepted socket for the loop thread to register
+void EventLoop::add_client(int csock) {
+    bool need_wakeup;
+    {
+        Guard guard(m_lock);
+        need_wakeup = m_new_clients.empty() && m_ready.empty() && m_unblocked.empty();
+        m_new_clients.push_back(csock);
+    }
+    // One write is enough until the loop drains the lists
+    if (need_wakeup) {
+        uint64_t one = 1;
+        ssize_t rc = write(m_wakefd, &one, sizeof(one));
+        (void) rc;
+    }
+}
+
+// Called by a sender's broadcast when a receiver's queue becomes non-empty
+void EventLoop::on_message_available(uint64_t cookie) {
+    bool need_wakeup;
+    {
+        Guard guard(m_lock);
+        need_wakeup = m_new_clients.empty() && m_ready.empty() && m_unblocked.empty();
+        m_ready.push_back(cookie);
+    }
+    if (need_wakeup) {
+        uint64_t one = 1;
+        ssize_t rc = write(m_wakefd, &one, sizeof(one));
+        (void) rc;
+    }
+}
+
+// Called by a receiver's dequeue when a full queue that a sender's
+// broadcast is blocked on has room
+void EventLoop::on_space_available(uint64_t cookie) {
+    bool need_wakeup;
+    {
+        Guard guard(m_lock);
+        need_wakeup = m_new_clients.empty() && m_ready.empty() && m_unblocked.empty();
+        m_unblocked.push_back(cookie);
+    }
+    if (need_wakeup) {
+        uint64_t one = 1;
+        ssize_t rc = write(m_wakefd, &one, sizeof(one));
+        (void) rc;
+    }
+}
+
+// Thread entry point
+void *EventLoop::run(void *arg) {
+    static_cast<EventLoop *>(arg)->loop();
+    return nullptr;
+}
+
+// Main loop: wait for readiness and dispatch to clients
+void EventLoop::loop() {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        // (a parked sender's broadcast is dropped at its deadline)
+        int n = epoll_wait(m_epfd, events, MAX_EVENTS, parked_timeout());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t id = events[i].data.u64;
+            if (id == WAKEUP_ID) {
+                if (!handle_wakeup()) {
+                    return; // destructor asked us to stop
+                }
+                continue;
+            }
+
+            // The client may already have been closed by an earlier event
+            auto it = m_clients.find(id);
+            if (it != m_clients.end()) {
+                handle_client_event(it->second, events[i].events);
+            }
+        }
+        expire_parked();
+    }
+}
+
+// Pick up new sockets, receivers whose queues have messages, and
+// parked senders that may go on. Returns false if the loop should stop.
+bool EventLoop::handle_wakeup() {
+    // Reset the eventfd before taking the lists, so a notification
+    // that races with the swap below causes another wakeup
+    uint64_t count;
+    ssize_t rc = read(m_wakefd, &count, sizeof(count));
+    (void) rc;
+
+    std::vector<int> new_clients;
+    std::vector<uint64_t> ready;
+    std::vector<uint64_t> unblocked;
+    {
+        Guard guard(m_lock);
+        if (m_stopping) {
+            return false;
+        }
+        new_clients.swap(m_new_clients);
+        ready.swap(m_ready);
+        unblocked.swap(m_unblocked);
+    }
+
+    for (int csock : new_clients) {
+        register_client(csock);
+    }
+
+    for (uint64_t id : ready) {
+        // Ignore notifications for clients that have since disconnected
+        auto it = m_clients.find(id);
+        if (it != m_clients.end()) {
+            deliver_messages(it->second);
+        }
+    }
+
+    for (uint64_t id : unblocked) {
+        auto it = m_clients.find(id);
+        if (it != m_clients.end()) {
+            retry_parked(it->second);
+        }
+    }
+    return true;
+}
+
+// Start servicing a newly accepted socket
+void EventLoop::register_client(int csock) {
+    Connection* conn = new Connection(csock);
+    if (!conn->set_nonblocking()) {
+        delete conn;
+        return;
+    }
+    // Output is written once per event rather than once per message
+    conn->set_buffered();
+
+    Client* client = new Client;
+    client->id = m_next_id++;
+    client->state = Client::AWAIT_LOGIN;
+    client->info = new ClientInfo{conn, m_server, nullptr, nullptr, nullptr, false};
+    client->info->space_listener = this; // (see process_input)
+    client->info->space_cookie = client->id;
+    client->closing = false;
+
+    // Register for both directions once; being edge-triggered we only
+    // hear about transitions, and any data that arrived before this
+    // call is reported straight away
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = client->id;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, csock, &ev) < 0) {
+        session_cleanup(client->info);
+        delete client;
+        return;
+    }
+    m_clients[client->id] = client;
+}
+
+// React to socket readiness for one client
+void EventLoop::handle_client_event(Client *client, uint32_t events) {
+    if (events & EPOLLERR) {
+        close_client(client);
+        return;
+    }
+
+    // Write whatever output was waiting for the socket
+    if (!client->info->conn->flush()) {
+        close_client(client);
+        return;
+    }
+
+    // Handle input; this also resumes a client whose input was left
+    // unread while its output was backed up
+    if (!process_input(client)) {
+        return;
+    }
+
+    // A receiver may have stopped dequeuing because of backed up output
+    deliver_messages(client);
+}
+
+// Read and handle as many complete messages as are available.
+// Returns false if the client was closed.
+bool EventLoop::process_input(Client *client) {
+    ClientInfo* info = client->info;
+    Connection* conn = info->conn;
+
+    // A sender whose broadcast is blocked on full queues is parked:
+    // its input is left unread until retry_parked lets it go on
+    while (!client->closing && !info->blocked && conn->pending_output() < OUTPUT_HIGH_WATER) {
+        MessageView msg; // valid until the next receive
+        if (!conn->receive(msg)) {
+            if (conn->get_last_result() == Connection::WOULD_BLOCK) {
+                break; // socket drained, wait for the next edge
+            }
+            if (client->state == Client::AWAIT_JOIN) {
+                // Receiver failed to send a valid join
+                conn->send(Message(OP_ERR, "invalid message"));
+                client->closing = true;
+                break;
+            }
+            close_client(client); // client disconnected
+            return false;
+        }
+
+        Message reply;
+        bool keep_going = true;
+        switch (client->state) {
+        case Client::AWAIT_LOGIN:
+            keep_going = session_login(info, msg, reply);
+            if (keep_going) {
+                client->state = (msg.op == OP_SLOGIN) ? Client::SENDER : Client::AWAIT_JOIN;
+            }
+            break;
+        case Client::SENDER:
+            keep_going = session_sender_message(info, msg, reply);
+            break;
+        case Client::AWAIT_JOIN:
+            keep_going = session_receiver_join(info, msg, reply);
+            if (keep_going) {
+                client->state = Client::RECEIVER;
+                // Deliveries are now signalled through on_message_available
+                info->mqueue->set_listener(this, client->id);
+            }
+            break;
+        case Client::RECEIVER:
+            continue; // receivers have nothing more to say, ignore it
+        }
+
+        conn->send(reply);
+        if (info->blocked) {
+            m_parked.push_back(client->id);
+        }
+        if (!keep_going) {
+            client->closing = true;
+        } else if (info->binary && !conn->is_binary()) {
+            conn->set_binary(); // login reply sent, switch to frames
+        }
+    }
+
+    // Out of input for now: write all the replies together
+    if (!conn->flush()) {
+        close_client(client);
+        return false;
+    }
+
+    // Close once the final reply (if any) has been written
+    if (client->closing && conn->pending_output() == 0) {
+        close_client(client);
+        return false;
+    }
+    return true;
+}
+
+// Move queued deliveries to a receiver's socket, stopping if the
+// socket falls behind. Returns false if the client was closed.
+bool EventLoop::deliver_messages(Client *client) {
+    if (client->state != Client::RECEIVER) {
+        return true;
+    }
+
+    // A receiver this far behind is dropped (see QueueLimits)
+    if (client->info->mqueue->is_overflowed()) {
+        close_client(client);
+        return false;
+    }
+
+    Connection* conn = client->info->conn;
+    while (conn->pending_output() < OUTPUT_HIGH_WATER) {
+        // Gather whatever is queued and write it with one writev (the
+        // replay the receiver asked for when it joined comes first)
+        m_batch.clear();
+        uint64_t taken_ns = 0; // only live deliveries are timed
+        if (session_replay_batch(client->info, m_batch, DELIVERY_BATCH) == 0) {
+            if (client->info->mqueue->dequeue_batch(m_batch, DELIVERY_BATCH) == 0) {
+                break;
+            }
+            taken_ns = latency_stamp();
+        }
+        bool sent = conn->send_batch(m_batch);
+        if (sent && taken_ns != 0) {
+            session_record_sent(m_batch, taken_ns);
+        }
+        for (Delivery* msg : m_batch) {
+            msg->unref();
+        }
+        m_batch.clear();
+        if (!sent) {
+            close_client(client); // disconnected
+            return false;
+        }
+    }
+
+    // Nothing more queued (or the socket is backed up): write it out
+    if (!conn->flush()) {
+        close_client(client);
+        return false;
+    }
+    return true;
+}
+
+// Try a parked sender's blocked broadcast again, and once it is done
+// (placed, or dropped at its deadline) handle the sender's next commands
+void EventLoop::retry_parked(Client *client) {
+    if (!client->info->blocked) {
+        return; // a stale notification
+    }
+    if (!session_retry_blocked(client->info)) {
+        return;
+    }
+    unpark(client->id);
+    process_input(client);
+}
+
+// Forget a sender that is no longer parked
+void EventLoop::unpark(uint64_t id) {
+    for (size_t i = 0; i < m_parked.size(); i++) {
+        if (m_parked[i] == id) {
+            m_parked[i] = m_parked.back();
+            m_parked.pop_back();
+            return;
+        }
+    }
+}
+
+// How long epoll_wait may sleep (in ms, -1 for ever) before the first
+// parked sender's deadline
+int EventLoop::parked_timeout() const {
+    if (m_parked.empty()) {
+        return -1;
+    }
+    uint64_t first = UINT64_MAX;
+    for (uint64_t id : m_parked) {
+        first = std::min(first, m_clients.at(id)->info->blocked->deadline_ns);
+    }
+    uint64_t now = latency_now();
+    return first > now ? (int) ((first - now + 999999) / 1000000) : 0;
+}
+
+// Let go of the parked senders whose deadlines have passed
+void EventLoop::expire_parked() {
+    if (m_parked.empty()) {
+        return;
+    }
+    uint64_t now = latency_now();
+    std::vector<uint64_t> parked(m_parked); // (retry_parked changes it)
+    for (uint64_t id : parked) {
+        auto it = m_clients.find(id);
+        if (it != m_clients.end() && it->second->info->blocked &&
+            it->second->info->blocked->deadline_ns <= now) {
+            retry_parked(it->second);
+        }
+    }
+}
+
+// Tear down a client's session
+void EventLoop::close_client(Client *client) {
+    ClientInfo* info = client->info;
+    if (info->mqueue) {
+        info->mqueue->set_listener(nullptr, 0);
+    }
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, info->conn->get_fd(), nullptr);
+    m_clients.erase(client->id);
+    unpark(client->id); // (session_cleanup drops a blocked broadcast)
+    session_cleanup(info);
+    delete client;
+}
@@ -0,0 +1,75 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+#include "message_queue.h"
+class Server;
+class Delivery;
+
+// An EventLoop services many clients on a single thread using
+// edge-triggered epoll. Each client's login, sender, and receiver
+// protocol is run as a small state machine driven by socket readiness
+// and by notifications from the client's MessageQueue, so no thread
+// ever blocks on a single client.
+class EventLoop : public QueueListener {
+public:
+  EventLoop(Server *server);
+  ~EventLoop();
+
+  // Create the epoll instance and start the loop thread
+  bool start();
+
+  // Hand over an accepted client socket (may be called from any thread)
+  void add_client(int csock);
+
+  // QueueListener: a receiver's queue has messages (any thread)
+  virtual void on_message_available(uint64_t cookie);
+
+  // QueueListener: a full queue that a sender's broadcast is blocked
+  // on may have room (any thread)
+  virtual void on_space_available(uint64_t cookie);
+
+private:
+  // prohibit value semantics
+  EventLoop(const EventLoop &);
+  EventLoop &operator=(const EventLoop &);
+
+  struct Client;
+
+  static void *run(void *arg);
+  void loop();
+  bool handle_wakeup();
+  void register_client(int csock);
+  void handle_client_event(Client *client, uint32_t events);
+  bool process_input(Client *client);
+  bool deliver_messages(Client *client);
+  void retry_parked(Client *client);
+  void unpark(uint64_t id);
+  int parked_timeout() const;
+  void expire_parked();
+  void close_client(Client *client);
+
+  Server *m_server;
+  int m_epfd;   // epoll instance
+  int m_wakefd; // eventfd used to wake the loop from other threads
+  pthread_t m_thread;
+  bool m_started;
+
+  // state shared with other threads, protected by m_lock
+  pthread_mutex_t m_lock;
+  std::vector<int> m_new_clients;  // accepted sockets not yet registered
+  std::vector<uint64_t> m_ready;   // ids of receivers with queued messages
+  std::vector<uint64_t> m_unblocked; // ids of parked senders to retry
+  bool m_stopping;                 // set by the destructor to end the loop
+
+  // state only touched by the loop thread
+  std::unordered_map<uint64_t, Client *> m_clients;
+  uint64_t m_next_id;
+  std::vector<uint64_t> m_parked;  // ids of senders with a blocked broadcast
+  std::vector<Delivery *> m_batch; // scratch space for deliver_messages
+};
+
+#endif // EVENT_LOOP_H
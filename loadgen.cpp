@@ -0,0 +1,656 @@
+// Load generator: simulates many senders and receivers in a single
+// process, all driven by one epoll loop, against a running server.
+// The senders are spread over the rooms and send numbered, timestamped
+// messages at a steady rate; every receiver checks that each sender in
+// its room reached it completely and in order, and times the messages
+// from the sender's write to its own read.
+//
+//   ./server 5000 &
+//   ./loadgen -s 100 -r 2000 -n 10 -z 64 -t 50 -d 10 localhost 5000
+//
+// Usage: loadgen [options] <server_address> <port>
+//
+// It prints a line of progress every second (to stderr) and a summary
+// at the end, and exits with status 1 if any message was lost,
+// reordered or rejected, or any client was disconnected.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include "csapp.h"
+#include "message.h"
+#include "connection.h"
+#include "client_util.h"
+#include "metrics.h"
+
+namespace {
+  const uint64_t NS_PER_SEC = 1000000000;
+
+  // Senders are given their due messages every tick
+  const long TICK_NS = 1000000;
+
+  // Once the senders stop, wait for the last deliveries until none
+  // have arrived for DRAIN_IDLE_NS (but no longer than DRAIN_MAX_NS)
+  const uint64_t DRAIN_IDLE_NS = NS_PER_SEC;
+  const uint64_t DRAIN_MAX_NS = 10 * NS_PER_SEC;
+
+  const int MAX_EVENTS = 256;
+
+  // A message's text starts with "<seq> <send time> " (then padding)
+  const size_t MAX_HEADER_LEN = 42;
+
+  const char SENDER_PREFIX[] = "lgs";
+  const char RECEIVER_PREFIX[] = "lgr";
+  const char ROOM_PREFIX[] = "lg";
+
+  struct Options {
+    std::string hostname;
+    int port;
+    unsigned num_senders;
+    unsigned num_receivers;
+    unsigned num_rooms;
+    size_t msg_size;  // bytes of text in each message
+    double rate;      // messages per second per sender (0: no limit)
+    unsigned window;  // messages a sender may have awaiting a reply
+    unsigned secs;    // how long the senders send
+    bool binary;
+
+    Options()
+      : port(0)
+      , num_senders(10)
+      , num_receivers(100)
+      , num_rooms(1)
+      , msg_size(64)
+      , rate(100)
+      , window(8)
+      , secs(10)
+      , binary(false) { }
+  };
+
+  void usage() {
+    std::cerr << "Usage: loadgen [options] <server_address> <port>\n"
+              << "Options:\n"
+              << "  -s N      senders (default 10)\n"
+              << "  -r N      receivers (default 100)\n"
+              << "  -n N      rooms; senders and receivers are spread over them (default 1)\n"
+              << "  -z BYTES  size of each message's text (default 64)\n"
+              << "  -t RATE   messages per second from each sender (default 100;\n"
+              << "            0: as fast as the window allows)\n"
+              << "  -w N      messages a sender may send before their replies (default 8)\n"
+              << "  -d SECS   how long to send for (default 10)\n"
+              << "  -b        use the binary protocol\n";
+  }
+
+  std::string room_name(unsigned room) {
+    return ROOM_PREFIX + std::to_string(room);
+  }
+
+  // The decimal number at the front of s (advanced past it), or false
+  // if there is none
+  bool parse_number(StringView &s, uint64_t &value) {
+    size_t i = 0;
+    value = 0;
+    while (i < s.len && s.ptr[i] >= '0' && s.ptr[i] <= '9') {
+      value = value * 10 + (s.ptr[i] - '0');
+      i++;
+    }
+    s = StringView(s.ptr + i, s.len - i);
+    return i > 0;
+  }
+
+  struct Client {
+    Connection conn;
+    bool is_sender;
+    unsigned index;  // among the senders, or among the receivers
+    unsigned room;
+    bool writing;    // waiting for the socket to take pending output
+
+    Client(bool is_sender, unsigned index, unsigned room)
+      : is_sender(is_sender), index(index), room(room), writing(false) { }
+  };
+
+  struct Sender : Client {
+    uint64_t sent;       // also the sequence number of the latest message
+    uint64_t acked;      // messages the server replied ok to
+    uint64_t rejected;   // ... and replied with an error to
+    unsigned in_flight;  // messages not replied to yet
+    double phase;        // spreads the senders' messages over each tick
+    Message out;
+
+    Sender(unsigned index, unsigned room, double phase)
+      : Client(true, index, room), sent(0), acked(0), rejected(0), in_flight(0)
+      , phase(phase), out(OP_SENDALL, "") { }
+  };
+
+  struct Receiver : Client {
+    // For each sender in the room (sender index / number of rooms): how
+    // many of its messages arrived, and the highest sequence number seen
+    std::vector<uint64_t> received;
+    std::vector<uint64_t> highest;
+
+    Receiver(unsigned index, unsigned room, unsigned senders_in_room)
+      : Client(false, index, room), received(senders_in_room), highest(senders_in_room) { }
+  };
+
+  class LoadGen {
+  public:
+    LoadGen(const Options &options);
+    ~LoadGen();
+
+    // Log in every client and join its room (blocking, one at a time)
+    bool connect_all();
+
+    // Send for the configured time, then wait for the last deliveries
+    void run();
+
+    // Print the summary; the exit status
+    int report();
+
+  private:
+    // prohibit value semantics
+    LoadGen(const LoadGen &);
+    LoadGen &operator=(const LoadGen &);
+
+    unsigned senders_in_room(unsigned room) const;
+    bool log_in(Client *client, Opcode login_op, const std::string &username);
+    void on_tick(uint64_t now);
+    void send_due(Sender *sender, uint64_t due);
+    void flush(Client *client);
+    void on_readable(Client *client);
+    void on_reply(Sender *sender, const MessageView &msg);
+    void on_delivery(Receiver *receiver, const MessageView &msg);
+    void drop(Client *client);
+    void print_progress(uint64_t now);
+
+    Options m_options;
+    std::vector<Sender *> m_senders;
+    std::vector<Receiver *> m_receivers;
+    std::vector<unsigned> m_room_receivers; // receivers in each room
+    int m_epfd;
+    int m_timerfd;
+
+    uint64_t m_start_ns, m_stop_ns, m_last_delivery_ns;
+    bool m_sending;
+    unsigned m_in_flight; // over all senders
+
+    uint64_t m_expected;  // deliveries of the messages acked so far
+    uint64_t m_delivered;
+    uint64_t m_reordered;
+    uint64_t m_malformed;
+    uint64_t m_disconnected;
+    std::vector<uint64_t> m_latency; // HDR buckets (metrics.h)
+
+    // Totals at the last progress line
+    uint64_t m_progress_ns, m_progress_sent, m_progress_delivered;
+  };
+
+  LoadGen::LoadGen(const Options &options)
+    : m_options(options)
+    , m_room_receivers(options.num_rooms)
+    , m_epfd(-1)
+    , m_timerfd(-1)
+    , m_start_ns(0)
+    , m_stop_ns(0)
+    , m_last_delivery_ns(0)
+    , m_sending(false)
+    , m_in_flight(0)
+    , m_expected(0)
+    , m_delivered(0)
+    , m_reordered(0)
+    , m_malformed(0)
+    , m_disconnected(0)
+    , m_latency(LATENCY_BUCKETS)
+    , m_progress_ns(0)
+    , m_progress_sent(0)
+    , m_progress_delivered(0) {
+    for (unsigned i = 0; i < options.num_senders; i++) {
+      m_senders.push_back(new Sender(i, i % options.num_rooms, (double) i / options.num_senders));
+    }
+    for (unsigned i = 0; i < options.num_receivers; i++) {
+      unsigned room = i % options.num_rooms;
+      m_receivers.push_back(new Receiver(i, room, senders_in_room(room)));
+      m_room_receivers[room]++;
+    }
+  }
+
+  LoadGen::~LoadGen() {
+    for (Sender *sender : m_senders) {
+      delete sender;
+    }
+    for (Receiver *receiver : m_receivers) {
+      delete receiver;
+    }
+    if (m_timerfd >= 0) {
+      close(m_timerfd);
+    }
+    if (m_epfd >= 0) {
+      close(m_epfd);
+    }
+  }
+
+  // Sender i is in room i % num_rooms
+  unsigned LoadGen::senders_in_room(unsigned room) const {
+    unsigned n = m_options.num_senders / m_options.num_rooms;
+    return room < m_options.num_senders % m_options.num_rooms ? n + 1 : n;
+  }
+
+  bool LoadGen::connect_all() {
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0) {
+      std::cerr << "Error: epoll_create1 failed\n";
+      return false;
+    }
+
+    // Receivers first, so that none misses a message
+    for (Receiver *receiver : m_receivers) {
+      if (!log_in(receiver, OP_RLOGIN, RECEIVER_PREFIX + std::to_string(receiver->index))) {
+        return false;
+      }
+    }
+    for (Sender *sender : m_senders) {
+      if (!log_in(sender, OP_SLOGIN, SENDER_PREFIX + std::to_string(sender->index))) {
+        return false;
+      }
+      sender->conn.set_buffered();
+    }
+    return true;
+  }
+
+  bool LoadGen::log_in(Client *client, Opcode login_op, const std::string &username) {
+    Connection &conn = client->conn;
+    conn.connect(m_options.hostname, m_options.port);
+    if (!conn.is_open()) {
+      std::cerr << "Error: could not connect " << username << " to the server\n";
+      return false;
+    }
+
+    Message reply;
+    Message login(login_op, m_options.binary ? username + PROTO_V2_REQUEST : username);
+    if (!conn.send(login) || !conn.receive(reply) || reply.op != OP_OK) {
+      std::cerr << "Error: " << username << " could not log in"
+                << (reply.op == OP_ERR ? ": " + reply.data : "") << "\n";
+      return false;
+    }
+    if (m_options.binary && binary_protocol_accepted(reply)) {
+      conn.set_binary();
+    }
+
+    Message join(OP_JOIN, room_name(client->room));
+    if (!conn.send(join) || !conn.receive(reply) || reply.op != OP_OK) {
+      std::cerr << "Error: " << username << " could not join a room"
+                << (reply.op == OP_ERR ? ": " + reply.data : "") << "\n";
+      return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    if (!conn.set_nonblocking() || epoll_ctl(m_epfd, EPOLL_CTL_ADD, conn.get_fd(), &ev) < 0) {
+      std::cerr << "Error: could not watch " << username << "'s connection\n";
+      return false;
+    }
+    return true;
+  }
+
+  void LoadGen::run() {
+    // Deliveries are timed from when they are read (Connection stamps
+    // every read once timing is on)
+    latency_set_enabled(true);
+
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec tick = { { 0, TICK_NS }, { 0, TICK_NS } };
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr; // (not a client)
+    if (m_timerfd < 0 || timerfd_settime(m_timerfd, 0, &tick, nullptr) < 0 ||
+        epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_timerfd, &ev) < 0) {
+      std::cerr << "Error: could not start the timer\n";
+      return;
+    }
+
+    m_start_ns = m_progress_ns = m_last_delivery_ns = latency_now();
+    m_sending = true;
+    on_tick(m_start_ns);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+      int n = epoll_wait(m_epfd, events, MAX_EVENTS, -1);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        std::cerr << "Error: epoll_wait failed\n";
+        return;
+      }
+
+      for (int i = 0; i < n; i++) {
+        Client *client = static_cast<Client *>(events[i].data.ptr);
+        if (!client) {
+          uint64_t expirations;
+          ssize_t rc = read(m_timerfd, &expirations, sizeof(expirations));
+          (void) rc;
+          on_tick(latency_now());
+          continue;
+        }
+        if (events[i].events & EPOLLOUT) {
+          flush(client);
+        }
+        if (client->conn.is_open() && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+          on_readable(client);
+        }
+      }
+
+      if (!m_sending) {
+        uint64_t now = latency_now();
+        bool done = m_delivered >= m_expected || now - m_last_delivery_ns >= DRAIN_IDLE_NS;
+        if ((m_in_flight == 0 && done) || now - m_stop_ns >= DRAIN_MAX_NS) {
+          return;
+        }
+      }
+    }
+  }
+
+  void LoadGen::on_tick(uint64_t now) {
+    if (m_sending && now - m_start_ns >= m_options.secs * NS_PER_SEC) {
+      m_sending = false;
+      m_stop_ns = now;
+    }
+    if (m_sending) {
+      double elapsed = (now - m_start_ns) / 1e9;
+      for (Sender *sender : m_senders) {
+        if (!sender->conn.is_open()) {
+          continue;
+        }
+        uint64_t due = m_options.rate > 0 ? (uint64_t) (elapsed * m_options.rate + sender->phase)
+                                          : UINT64_MAX;
+        send_due(sender, due);
+      }
+    }
+    if (now - m_progress_ns >= NS_PER_SEC) {
+      print_progress(now);
+    }
+  }
+
+  // Send a sender's messages up to number due, as far as its window allows
+  void LoadGen::send_due(Sender *sender, uint64_t due) {
+    char header[MAX_HEADER_LEN + 1];
+    std::string &text = sender->out.data;
+    bool sent = false;
+    while (sender->sent < due && sender->in_flight < m_options.window) {
+      sender->sent++;
+      int len = snprintf(header, sizeof(header), "%llu %llu ",
+                         (unsigned long long) sender->sent, (unsigned long long) latency_now());
+      text.assign(header, len);
+      if (text.size() < m_options.msg_size) {
+        text.append(m_options.msg_size - text.size(), 'x');
+      }
+      if (!sender->conn.send(sender->out)) {
+        drop(sender);
+        return;
+      }
+      sender->in_flight++;
+      m_in_flight++;
+      sent = true;
+    }
+    if (sent) {
+      flush(sender);
+    }
+  }
+
+  // Write pending output, watching for the socket to become writable
+  // while some is left
+  void LoadGen::flush(Client *client) {
+    if (!client->conn.flush()) {
+      drop(client);
+      return;
+    }
+    bool writing = client->conn.pending_output() > 0;
+    if (writing != client->writing) {
+      struct epoll_event ev;
+      ev.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+      ev.data.ptr = client;
+      epoll_ctl(m_epfd, EPOLL_CTL_MOD, client->conn.get_fd(), &ev);
+      client->writing = writing;
+    }
+  }
+
+  void LoadGen::on_readable(Client *client) {
+    MessageView msg;
+    while (client->conn.receive(msg)) {
+      if (client->is_sender) {
+        on_reply(static_cast<Sender *>(client), msg);
+      } else {
+        on_delivery(static_cast<Receiver *>(client), msg);
+      }
+    }
+    if (client->conn.get_last_result() != Connection::WOULD_BLOCK) {
+      drop(client);
+    }
+  }
+
+  void LoadGen::on_reply(Sender *sender, const MessageView &msg) {
+    if (sender->in_flight == 0) {
+      m_malformed++; // a reply to nothing
+      return;
+    }
+    sender->in_flight--;
+    m_in_flight--;
+    if (msg.op == OP_OK) {
+      sender->acked++;
+      m_expected += m_room_receivers[sender->room];
+    } else {
+      sender->rejected++;
+    }
+
+    // Without a rate, every reply makes room for another message
+    if (m_sending && m_options.rate == 0) {
+      send_due(sender, UINT64_MAX);
+    }
+  }
+
+  // Check a "room:sender:<seq> <send time> ..." delivery
+  void LoadGen::on_delivery(Receiver *receiver, const MessageView &msg) {
+    StringView data = msg.data;
+    const char *colon = static_cast<const char *>(memchr(data.ptr, ':', data.len));
+    const size_t prefix_len = sizeof(SENDER_PREFIX) - 1;
+    uint64_t sender_index, seq, sent_ns;
+    if (msg.op != OP_DELIVERY || !colon ||
+        data.ptr + data.len - (colon + 1) < (ptrdiff_t) prefix_len ||
+        memcmp(colon + 1, SENDER_PREFIX, prefix_len) != 0) {
+      m_malformed++;
+      return;
+    }
+    data = StringView(colon + 1 + prefix_len, data.ptr + data.len - (colon + 1 + prefix_len));
+    if (!parse_number(data, sender_index) || data.len < 1 || data.ptr[0] != ':' ||
+        sender_index >= m_options.num_senders ||
+        sender_index % m_options.num_rooms != receiver->room) {
+      m_malformed++;
+      return;
+    }
+    data = StringView(data.ptr + 1, data.len - 1);
+    if (!parse_number(data, seq) || data.len < 1 || data.ptr[0] != ' ') {
+      m_malformed++;
+      return;
+    }
+    data = StringView(data.ptr + 1, data.len - 1);
+    if (!parse_number(data, sent_ns) || seq == 0) {
+      m_malformed++;
+      return;
+    }
+
+    unsigned pos = sender_index / m_options.num_rooms;
+    receiver->received[pos]++;
+    if (seq <= receiver->highest[pos]) {
+      m_reordered++;
+    } else {
+      receiver->highest[pos] = seq;
+    }
+    m_delivered++;
+    m_last_delivery_ns = msg.received_ns;
+    if (msg.received_ns > sent_ns) {
+      m_latency[latency_bucket(msg.received_ns - sent_ns)]++;
+    } else {
+      m_latency[0]++;
+    }
+  }
+
+  // A client the server disconnected (or that failed)
+  void LoadGen::drop(Client *client) {
+    if (!client->conn.is_open()) {
+      return;
+    }
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, client->conn.get_fd(), nullptr);
+    client->conn.close();
+    m_disconnected++;
+    if (client->is_sender) {
+      Sender *sender = static_cast<Sender *>(client);
+      m_in_flight -= sender->in_flight;
+      sender->in_flight = 0;
+    }
+  }
+
+  void LoadGen::print_progress(uint64_t now) {
+    uint64_t sent = 0;
+    for (Sender *sender : m_senders) {
+      sent += sender->sent;
+    }
+    double secs = (now - m_progress_ns) / 1e9;
+    fprintf(stderr, "t=%.0fs sent/sec=%.0f delivered/sec=%.0f in_flight=%u\n",
+            (now - m_start_ns) / 1e9, (sent - m_progress_sent) / secs,
+            (m_delivered - m_progress_delivered) / secs, m_in_flight);
+    m_progress_ns = now;
+    m_progress_sent = sent;
+    m_progress_delivered = m_delivered;
+  }
+
+  int LoadGen::report() {
+    uint64_t sent = 0, acked = 0, rejected = 0;
+    for (Sender *sender : m_senders) {
+      sent += sender->sent;
+      acked += sender->acked;
+      rejected += sender->rejected;
+    }
+
+    // A message is lost for every receiver in its room that never got it
+    uint64_t lost = 0;
+    for (Receiver *receiver : m_receivers) {
+      for (unsigned pos = 0; pos < receiver->received.size(); pos++) {
+        uint64_t acked_by_server = m_senders[pos * m_options.num_rooms + receiver->room]->acked;
+        if (receiver->received[pos] < acked_by_server) {
+          lost += acked_by_server - receiver->received[pos];
+        }
+      }
+    }
+
+    uint64_t stop_ns = m_stop_ns ? m_stop_ns : latency_now(); // (if run failed)
+    double send_secs = stop_ns > m_start_ns ? (stop_ns - m_start_ns) / 1e9 : 1.0;
+    double deliver_secs = m_last_delivery_ns > m_start_ns ? (m_last_delivery_ns - m_start_ns) / 1e9 : 1.0;
+    const uint64_t *latency = m_latency.data();
+    unsigned last = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+      if (latency[i] > 0) {
+        last = i;
+      }
+    }
+
+    printf("loadgen senders=%u receivers=%u rooms=%u size=%zu rate=%g window=%u secs=%u protocol=%s\n",
+           m_options.num_senders, m_options.num_receivers, m_options.num_rooms, m_options.msg_size,
+           m_options.rate, m_options.window, m_options.secs, m_options.binary ? "binary" : "text");
+    printf("sent=%llu acked=%llu rejected=%llu msgs/sec=%.0f\n",
+           (unsigned long long) sent, (unsigned long long) acked, (unsigned long long) rejected,
+           sent / send_secs);
+    printf("delivered=%llu expected=%llu msgs/sec=%.0f\n",
+           (unsigned long long) m_delivered, (unsigned long long) m_expected, m_delivered / deliver_secs);
+    printf("lost=%llu reordered=%llu malformed=%llu disconnected=%llu\n",
+           (unsigned long long) lost, (unsigned long long) m_reordered,
+           (unsigned long long) m_malformed, (unsigned long long) m_disconnected);
+    printf("latency_ns p50=%llu p99=%llu p999=%llu max=%llu\n",
+           (unsigned long long) latency_percentile(latency, m_delivered, 500),
+           (unsigned long long) latency_percentile(latency, m_delivered, 990),
+           (unsigned long long) latency_percentile(latency, m_delivered, 999),
+           (unsigned long long) (m_delivered > 0 ? latency_bucket_max(last) : 0));
+
+    bool clean = lost == 0 && m_reordered == 0 && rejected == 0 && m_malformed == 0 &&
+                 m_disconnected == 0;
+    return clean ? 0 : 1;
+  }
+
+  // Allow as many open files as the hard limit does (each simulated
+  // client is a socket)
+  void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:n:z:t:w:d:b")) != -1) {
+    switch (opt) {
+    case 's':
+      options.num_senders = atoi(optarg);
+      break;
+    case 'r':
+      options.num_receivers = atoi(optarg);
+      break;
+    case 'n':
+      options.num_rooms = atoi(optarg);
+      break;
+    case 'z':
+      options.msg_size = atoi(optarg);
+      break;
+    case 't':
+      options.rate = atof(optarg);
+      break;
+    case 'w':
+      options.window = atoi(optarg);
+      break;
+    case 'd':
+      options.secs = atoi(optarg);
+      break;
+    case 'b':
+      options.binary = true;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind != argc - 2 || options.num_rooms == 0 || options.window == 0 || options.rate < 0) {
+    usage();
+    return 1;
+  }
+  options.hostname = argv[optind];
+  options.port = std::stoi(argv[optind + 1]);
+
+  // A delivery ("room:sender:text") must fit in one text message, in
+  // either protocol, or the server rejects the sendall
+  size_t names_len = room_name(options.num_rooms - 1).size() + sizeof(SENDER_PREFIX) +
+                     std::to_string(options.num_senders).size() + 1;
+  size_t max_size = Message::MAX_LEN - 1 - strlen(TAG_DELIVERY) - 1 - names_len;
+  if (options.msg_size > max_size) {
+    std::cerr << "Error: messages can be at most " << max_size << " bytes\n";
+    return 1;
+  }
+
+  // The server may close a receiver's connection before it is done
+  signal(SIGPIPE, SIG_IGN);
+  raise_fd_limit();
+
+  LoadGen loadgen(options);
+  if (!loadgen.connect_all()) {
+    return 1;
+  }
+  loadgen.run();
+  return loadgen.report();
+}
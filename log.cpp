@@ -0,0 +1,171 @@
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <pthread.h>
+#include "guard.h"
+#include "log.h"
+
+std::atomic<int> g_log_level(LOG_LEVEL_INFO);
+
+namespace {
+    // Each thread's ring holds RING_ENTRIES fixed-size entries; longer
+    // messages are truncated
+    const unsigned RING_ENTRIES = 256;
+    const unsigned ENTRY_SIZE = 256;
+
+    // How long the writer thread sleeps when there is nothing to write
+    const long FLUSH_INTERVAL_NS = 20 * 1000 * 1000;
+
+    // Single-producer (the owning thread), single-consumer (the writer
+    // thread) ring of formatted messages
+    struct Ring {
+        char entries[RING_ENTRIES][ENTRY_SIZE];
+        std::atomic<unsigned> head;  // next entry the writer will read
+        std::atomic<unsigned> tail;  // next entry the owner will fill
+        std::atomic<bool> orphaned;  // owner exited; free once drained
+
+        Ring() : head(0), tail(0), orphaned(false) { }
+    };
+
+    pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<Ring *> g_rings; // protected by g_rings_lock
+
+    std::atomic<bool> g_started(false);
+    std::atomic<unsigned long> g_dropped(0);
+
+    pthread_key_t g_ring_key;
+    pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+    thread_local Ring *t_ring = nullptr;
+
+    // Thread exit: the writer frees the ring after draining it
+    void orphan_ring(void *arg) {
+        static_cast<Ring *>(arg)->orphaned.store(true, std::memory_order_release);
+    }
+
+    void create_key() {
+        pthread_key_create(&g_ring_key, orphan_ring);
+    }
+
+    // This thread's ring, created the first time it logs
+    Ring *get_ring() {
+        if (!t_ring) {
+            pthread_once(&g_key_once, create_key);
+            t_ring = new Ring();
+            pthread_setspecific(g_ring_key, t_ring);
+            Guard guard(g_rings_lock);
+            g_rings.push_back(t_ring);
+        }
+        return t_ring;
+    }
+
+    // Write out everything in one ring; returns the number of messages
+    unsigned drain(Ring *ring) {
+        unsigned head = ring->head.load(std::memory_order_relaxed);
+        unsigned tail = ring->tail.load(std::memory_order_acquire);
+        for (unsigned i = head; i != tail; i++) {
+            fputs(ring->entries[i % RING_ENTRIES], stdout);
+        }
+        // Let the owner reuse the entries
+        ring->head.store(tail, std::memory_order_release);
+        return tail - head;
+    }
+
+    // Writer thread: drain every ring, then sleep if there was nothing
+    void *writer(void *) {
+        while (true) {
+            unsigned written = 0;
+            {
+                Guard guard(g_rings_lock);
+                size_t kept = 0;
+                for (size_t i = 0; i < g_rings.size(); i++) {
+                    Ring *ring = g_rings[i];
+                    // Check orphaned first: once set, the owner writes no more
+                    bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+                    written += drain(ring);
+                    if (orphaned) {
+                        delete ring;
+                    } else {
+                        g_rings[kept++] = ring;
+                    }
+                }
+                g_rings.resize(kept);
+            }
+
+            if (written > 0) {
+                fflush(stdout);
+            } else {
+                struct timespec ts = { 0, FLUSH_INTERVAL_NS };
+                nanosleep(&ts, nullptr);
+            }
+        }
+        return nullptr;
+    }
+}
+
+// Change the runtime level
+void log_set_level(int level) {
+    g_log_level.store(level, std::memory_order_relaxed);
+}
+
+// Map a level name to its value
+int log_level_from_name(const char *name) {
+    static const char *const names[] = { "debug", "info", "warn", "error", "off" };
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_OFF; level++) {
+        if (strcmp(name, names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+// Start the writer thread
+void log_start() {
+    bool expected = false;
+    if (!g_started.compare_exchange_strong(expected, true)) {
+        return; // already running
+    }
+    pthread_t thr_id;
+    pthread_create(&thr_id, nullptr, writer, nullptr);
+    pthread_detach(thr_id);
+}
+
+// Format a message into the calling thread's ring
+void log_write(int level, const char *fmt, ...) {
+    (void) level;
+    va_list args;
+
+    // Until the writer runs (e.g., in benchmarks), write directly
+    if (!g_started.load(std::memory_order_relaxed)) {
+        va_start(args, fmt);
+        vprintf(fmt, args);
+        va_end(args);
+        return;
+    }
+
+    Ring *ring = get_ring();
+    unsigned tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) == RING_ENTRIES) {
+        g_dropped.fetch_add(1, std::memory_order_relaxed);
+        return; // full: drop rather than wait
+    }
+
+    char *entry = ring->entries[tail % RING_ENTRIES];
+    va_start(args, fmt);
+    int len = vsnprintf(entry, ENTRY_SIZE, fmt, args);
+    va_end(args);
+
+    // Keep the newline of a truncated message
+    if (len >= (int) ENTRY_SIZE && entry[ENTRY_SIZE - 2] != '\n') {
+        entry[ENTRY_SIZE - 2] = '\n';
+    }
+
+    // Publish the entry to the writer
+    ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+// Number of dropped messages
+unsigned long log_dropped() {
+    return g_dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,60 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+
+// Asynchronous logging. LOG_* calls format the message into a ring
+// buffer owned by the calling thread (no locks, no I/O), and a
+// background thread started by log_start writes the rings to stdout.
+// If a thread's ring is full the message is dropped and counted,
+// so logging can never stall the thread that does it.
+
+// log levels, from most to least verbose
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF   4
+
+// Messages below this level are compiled out entirely (their arguments
+// are not even evaluated): build with e.g. make LOG_LEVEL=2
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Messages below the runtime level (default LOG_LEVEL_INFO) are skipped
+extern std::atomic<int> g_log_level;
+
+inline bool log_enabled(int level) {
+  return level >= g_log_level.load(std::memory_order_relaxed);
+}
+
+void log_set_level(int level);
+
+// Parse a level name ("debug", "info", "warn", "error", "off");
+// returns -1 if the name is not recognized
+int log_level_from_name(const char *name);
+
+// Start the background thread that writes log messages
+void log_start();
+
+// Format a message into this thread's ring buffer
+void log_write(int level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+// Number of messages dropped because a ring buffer was full
+unsigned long log_dropped();
+
+#define LOG_AT(level, ...)                                            \
+  do {                                                                \
+    if ((level) >= LOG_COMPILE_LEVEL && log_enabled(level)) {         \
+      log_write((level), __VA_ARGS__);                                \
+    }                                                                 \
+  } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif // LOG_H
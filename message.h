@@ -3,24 +3,8 @@
 
 #include <vector>
 #include <string>
-
-struct Message {
-  // An encoded message may have at most this many characters,
-  // including the trailing newline ('\n'). Note that this does
-  // *not* include a NUL terminator (if one is needed to
-  // temporarily store the encoded message.)
-  static const unsigned MAX_LEN = 255;
-
-  std::string tag;
-  std::string data;
-
-  Message() { }
-
-  Message(const std::string &tag, const std::string &data)
-    : tag(tag), data(data) { }
-
-  // TODO: you could add helper functions
-};
+#include <cstring>
+#include <cstdint>
 
 // standard message tags (note that you don't need to worry about
 // "senduser" or "empty" messages)
@@ -36,4 +20,169 @@ struct Message {
 #define TAG_DELIVERY  "delivery"  // message delivered by server to receiving client
 #define TAG_EMPTY     "empty"     // sent by server to receiving client to indicate no msgs available
 
+// Binary protocol (version 2).
+//
+// A client asks for it by appending PROTO_V2_REQUEST to the username in
+// its slogin or rlogin message. If the server agrees, its ok reply ends
+// with PROTO_V2_ACCEPTED, and every message after that reply (in both
+// directions) is a frame instead of a "tag:data\n" line:
+//
+//   byte 0     opcode (one of the OP_ values below, in place of the tag)
+//   byte 1     flags (none are defined yet; send 0)
+//   bytes 2-3  length of the data, big-endian
+//   ...        the data itself (at most MAX_FRAME_DATA bytes)
+//
+// Clients that do not ask keep using the text protocol. Receivers of
+// both kinds may share a room, so the server rejects a sendall whose
+// delivery would not fit in a text message (Message::MAX_LEN), even
+// from a binary sender.
+#define PROTO_V2_REQUEST  " proto=2"
+#define PROTO_V2_ACCEPTED "; proto=2"
+
+// Replay on join.
+//
+// A room can keep its most recent deliveries (server -H), numbered by
+// a per-room sequence number that starts at 1. A receiver may then
+// follow the room name in its join message with JOIN_REPLAY_LAST and a
+// count, to be sent the last N deliveries before the live ones, or with
+// JOIN_REPLAY_SINCE and a sequence number, to be sent every delivery
+// from that one on (since=0 replays everything kept). Either number is
+// plain decimal digits; anything else gets an err reply. Deliveries
+// that are no longer kept are skipped.
+// In a room that keeps history the welcome reply ends with JOIN_SEQ and
+// the sequence number of the first live (not replayed) delivery.
+#define JOIN_REPLAY_LAST  " last="
+#define JOIN_REPLAY_SINCE " since="
+#define JOIN_SEQ          "; seq="
+
+static const unsigned FRAME_HEADER_LEN = 4;
+static const unsigned MAX_FRAME_DATA = 4096;
+
+// Every tag is interned to an opcode as soon as a message is received,
+// so the server compares and dispatches on small integers and never
+// copies a tag. The values are also the opcodes of the binary protocol,
+// so they must not change; OP_NONE stands for a tag that is not one of
+// the above (which is never sent).
+enum Opcode {
+  OP_NONE = 0,
+  OP_ERR,
+  OP_OK,
+  OP_SLOGIN,
+  OP_RLOGIN,
+  OP_JOIN,
+  OP_LEAVE,
+  OP_SENDALL,
+  OP_SENDUSER,
+  OP_QUIT,
+  OP_DELIVERY,
+  OP_EMPTY,
+  NUM_OPCODES
+};
+
+// The text protocol's spelling of an opcode
+struct OpcodeTag {
+  Opcode op;
+  const char *str;
+  unsigned len;
+};
+
+#define OPCODE_TAG(op, tag) { op, tag, sizeof(tag) - 1 }
+
+// Indexed by opcode
+static constexpr OpcodeTag OPCODE_TAGS[NUM_OPCODES] = {
+  OPCODE_TAG(OP_NONE, ""),
+  OPCODE_TAG(OP_ERR, TAG_ERR),
+  OPCODE_TAG(OP_OK, TAG_OK),
+  OPCODE_TAG(OP_SLOGIN, TAG_SLOGIN),
+  OPCODE_TAG(OP_RLOGIN, TAG_RLOGIN),
+  OPCODE_TAG(OP_JOIN, TAG_JOIN),
+  OPCODE_TAG(OP_LEAVE, TAG_LEAVE),
+  OPCODE_TAG(OP_SENDALL, TAG_SENDALL),
+  OPCODE_TAG(OP_SENDUSER, TAG_SENDUSER),
+  OPCODE_TAG(OP_QUIT, TAG_QUIT),
+  OPCODE_TAG(OP_DELIVERY, TAG_DELIVERY),
+  OPCODE_TAG(OP_EMPTY, TAG_EMPTY),
+};
+
+#undef OPCODE_TAG
+
+constexpr bool opcode_tags_in_order() {
+  for (unsigned i = 0; i < NUM_OPCODES; i++) {
+    if (OPCODE_TAGS[i].op != i) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(opcode_tags_in_order(), "OPCODE_TAGS must be indexed by opcode");
+
+// The tag an opcode stands for (op must be a valid Opcode)
+inline const OpcodeTag &opcode_tag(Opcode op) {
+  return OPCODE_TAGS[op];
+}
+
+// Whether a byte received in a frame header is a valid opcode
+inline bool is_opcode(unsigned value) {
+  return value > OP_NONE && value < NUM_OPCODES;
+}
+
+// Intern a received tag: its opcode, or OP_NONE if it has none
+inline Opcode tag_to_opcode(const char *tag, size_t len) {
+  for (unsigned op = OP_ERR; op < NUM_OPCODES; op++) {
+    if (OPCODE_TAGS[op].len == len && memcmp(OPCODE_TAGS[op].str, tag, len) == 0) {
+      return Opcode(op);
+    }
+  }
+  return OP_NONE;
+}
+
+struct Message {
+  // An encoded message may have at most this many characters,
+  // including the trailing newline ('\n'). Note that this does
+  // *not* include a NUL terminator (if one is needed to
+  // temporarily store the encoded message.)
+  static const unsigned MAX_LEN = 255;
+
+  Opcode op;        // the tag, interned (see opcode_tag)
+  std::string data;
+
+  Message() : op(OP_NONE) { }
+
+  Message(Opcode op, const std::string &data)
+    : op(op), data(data) { }
+};
+
+// A read-only view of characters stored somewhere else (std::string_view
+// would do, but this code is C++14)
+struct StringView {
+  const char *ptr;
+  size_t len;
+
+  StringView() : ptr(""), len(0) { }
+  StringView(const char *ptr, size_t len) : ptr(ptr), len(len) { }
+  StringView(const std::string &s) : ptr(s.data()), len(s.size()) { }
+
+  const char *data() const { return ptr; }
+  size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+
+  // Copy the characters into a string of their own
+  std::string str() const { return std::string(ptr, len); }
+
+  // Compare with a NUL-terminated string
+  bool operator==(const char *s) const {
+    return strlen(s) == len && memcmp(ptr, s, len) == 0;
+  }
+  bool operator!=(const char *s) const { return !(*this == s); }
+};
+
+// A received message that has not been copied out of the Connection's
+// input buffer. The views are only valid until the next call to
+// receive on that Connection.
+struct MessageView {
+  Opcode op;
+  StringView data;
+  uint64_t received_ns; // when it was read from the socket (latency_stamp)
+};
+
 #endif // MESSAGE_H
@@ -1,11 +1,84 @@
 #include <cassert>
+#include <cerrno>
 #include <ctime>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "message_queue.h"
-#include "message.h"
+#include "delivery.h"
 #include "guard.h"
+#include "metrics.h"
+
+// Wake whoever is polling a queue's eventfd
+void MessageQueue::signal_wakeup_fd(int fd) {
+    uint64_t one = 1;
+    ssize_t rc = write(fd, &one, sizeof(one));
+    (void) rc; // can only fail if the counter is already huge
+}
+
+void MessageQueue::ref() {
+    m_refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MessageQueue::unref() {
+    if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+// Register a producer to be told about room (once, however often it
+// is blocked before then)
+void MessageQueue::add_space_listener(SpaceListeners &listeners, QueueListener *listener,
+                                      uint64_t cookie) {
+    for (const auto &entry : listeners) {
+        if (entry.first == listener && entry.second == cookie) {
+            return;
+        }
+    }
+    listeners.push_back(std::make_pair(listener, cookie));
+}
+
+void MessageQueue::remove_space_listener(SpaceListeners &listeners, QueueListener *listener,
+                                         uint64_t cookie) {
+    for (size_t i = 0; i < listeners.size(); i++) {
+        if (listeners[i].first == listener && listeners[i].second == cookie) {
+            listeners[i] = listeners.back();
+            listeners.pop_back();
+            return;
+        }
+    }
+}
+
+// Tell the producers that were blocked that the consumer made room.
+// This is done with the lock that protects listeners held, so that
+// cancel_space_listener is final.
+void MessageQueue::notify_space(SpaceListeners &listeners) {
+    for (const auto &entry : listeners) {
+        entry.first->on_space_available(entry.second);
+    }
+    listeners.clear();
+}
+
+// Check a message against the limits (a message bigger than max_bytes
+// may still be queued on its own, or it could never be delivered)
+bool MessageQueue::fits(size_t count, size_t bytes, size_t size) const {
+    if (m_limits.max_messages != 0 && count >= m_limits.max_messages) {
+        return false;
+    }
+    return m_limits.max_bytes == 0 || count == 0 || bytes + size <= m_limits.max_bytes;
+}
+
+// The mutex-based queue (the default); see message_queue_lockfree.cpp
+#ifndef MQUEUE_LOCKFREE
 
 // Constructor for MessageQueue
-MessageQueue::MessageQueue() {
+MessageQueue::MessageQueue(const QueueLimits &limits)
+  : m_limits(limits)
+  , m_overflowed(false)
+  , m_refs(1)
+  , m_listener(nullptr)
+  , m_cookie(0)
+  , m_wakefd(-1)
+  , m_bytes(0) {
     // Initialize the mutex lock for thread safety
     pthread_mutex_init(&m_lock, nullptr);
     // Initialize the semaphore to track available messages (starting with 0)
@@ -14,13 +87,19 @@ MessageQueue::MessageQueue() {
 
 // Destructor for MessageQueue
 MessageQueue::~MessageQueue() {
-    // Guard to automatically lock/unlock the mutex
-    Guard guard(m_lock);
+    {
+        // Guard to automatically lock/unlock the mutex (scoped so that
+        // it is unlocked again before the mutex is destroyed)
+        Guard guard(m_lock);
 
-    // Clean up all remaining messages in the queue
-    while (!m_messages.empty()) {
-        delete m_messages.front();  // Free memory for each message
-        m_messages.pop_front();    // Remove from queue
+        // Clean up all remaining messages in the queue
+        while (!m_messages.empty()) {
+            m_messages.front().msg->unref();  // Drop the queue's reference
+            m_messages.pop_front();    // Remove from queue
+        }
+    }
+    if (m_wakefd >= 0) {
+        close(m_wakefd);
     }
     // Destroy the mutex and semaphore
     pthread_mutex_destroy(&m_lock);
@@ -28,19 +107,117 @@ MessageQueue::~MessageQueue() {
 }
 
 // Add a message to the queue
-void MessageQueue::enqueue(Message *msg) {
-    // Use a Guard to automatically lock/unlock the mutex
-    Guard guard(m_lock);
-    // Add the message to the end of the queue
-    m_messages.push_back(msg);
-    //printf("[queue] Enqueued message: %s\n", msg->data.c_str());
+MessageQueue::EnqueueResult MessageQueue::enqueue(Delivery *msg, QueueListener *space_listener,
+                                                  uint64_t space_cookie) {
+    EnqueueResult result = { 0, false, false };
+    size_t size = msg->get_wire_len(false);
+    QueueListener *listener;
+    uint64_t cookie;
+    int wakefd;
+    uint64_t ingress_ns = msg->get_ingress_ns(); // (msg may be gone once queued)
+    uint64_t enqueued_ns = 0;
+    {
+        // Use a Guard to automatically lock/unlock the mutex
+        Guard guard(m_lock);
+        bool was_empty = m_messages.empty();
+
+        // A full queue applies its policy; afterwards msg is either
+        // queued or discarded
+        bool discard = m_overflowed.load(std::memory_order_relaxed);
+        if (!discard && !fits(m_messages.size(), m_bytes, size)) {
+            if (m_limits.policy == QueueLimits::BLOCK && space_listener) {
+                // The producer keeps the message, to try again once
+                // the consumer has taken some
+                add_space_listener(m_space_listeners, space_listener, space_cookie);
+                result.blocked = true;
+                return result;
+            }
+            discard = !make_room(size, result);
+        }
+
+        if (!discard) {
+            // Add the message to the end of the queue
+            enqueued_ns = latency_stamp();
+            Entry entry = { msg, enqueued_ns };
+            m_messages.push_back(entry);
+            m_bytes += size;
+
+            // Increment the semaphore to indicate a new message is available
+            sem_post(&m_avail);
+        }
+
+        // Only the empty -> non-empty transition needs a notification,
+        // and so does an overflow (the receiver must notice it)
+        bool notify = (was_empty && !discard) || result.overflowed;
+        listener = notify ? m_listener : nullptr;
+        cookie = m_cookie;
+        wakefd = notify ? m_wakefd : -1;
 
-    // Increment the semaphore to indicate a new message is available
-    sem_post(&m_avail);
+        if (discard) {
+            msg->unref();
+            result.dropped++;
+        }
+    }
+
+    if (enqueued_ns != 0 && ingress_ns != 0) {
+        latency_record(LATENCY_INGRESS_TO_ENQUEUE, enqueued_ns - ingress_ns);
+    }
+
+    // Notify outside the lock so the listener can't stall other producers
+    // (the eventfd stays open until the queue is destroyed, which can't
+    // happen while a producer is still in enqueue)
+    if (listener) {
+        listener->on_message_available(cookie);
+    }
+    if (wakefd >= 0) {
+        signal_wakeup_fd(wakefd);
+    }
+    return result;
+}
+
+// Apply the policy for a message that doesn't fit (m_lock must be
+// held). Returns true if there is now room for it.
+bool MessageQueue::make_room(size_t size, EnqueueResult &result) {
+    switch (m_limits.policy) {
+    case QueueLimits::DROP_OLDEST:
+        // Only messages the consumer hasn't claimed (through the
+        // semaphore) may be dropped
+        while (!fits(m_messages.size(), m_bytes, size) && sem_trywait(&m_avail) == 0) {
+            Delivery *oldest = m_messages.front().msg;
+            m_messages.pop_front();
+            m_bytes -= oldest->get_wire_len(false);
+            oldest->unref();
+            result.dropped++;
+        }
+        break;
+
+    case QueueLimits::DROP_NEWEST:
+    case QueueLimits::BLOCK: // (the producer can't wait, see enqueue)
+        break;
+
+    case QueueLimits::DISCONNECT:
+        m_overflowed.store(true, std::memory_order_release);
+        result.overflowed = true;
+        break;
+    }
+    return fits(m_messages.size(), m_bytes, size);
+}
+
+// Take the message at the front of the queue for the consumer, which
+// has claimed it through the semaphore (m_lock must be held); now is
+// its latency_stamp
+Delivery *MessageQueue::take_front(uint64_t now) {
+    Entry entry = m_messages.front();
+    m_messages.pop_front();
+    if (now != 0 && entry.enqueued_ns != 0) {
+        latency_record(LATENCY_QUEUE_RESIDENCY, now - entry.enqueued_ns);
+    }
+    m_bytes -= entry.msg->get_wire_len(false);
+    return entry.msg;
 }
 
 // Remove and return a message from the queue
-Message *MessageQueue::dequeue() {
+Delivery *MessageQueue::dequeue() {
     // Set up a timeout of 1 second for the semaphore wait
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
@@ -58,8 +235,84 @@ Message *MessageQueue::dequeue() {
     if (m_messages.empty()) {
         return nullptr;
     }
-    // Get the first message from the queue
-    Message* msg = m_messages.front();
-    m_messages.pop_front();  // Remove it from the queue
-    return msg;              // Return the message
-}
\ No newline at end of file
+    // Remove the first message from the queue and return it
+    Delivery *msg = take_front(latency_stamp());
+    notify_space(m_space_listeners);
+    return msg;
+}
+
+// Remove and return a message from the queue without waiting
+Delivery *MessageQueue::try_dequeue() {
+    // Consume a semaphore count only if one is available
+    if (sem_trywait(&m_avail) != 0) {
+        return nullptr;
+    }
+
+    Guard guard(m_lock);
+    if (m_messages.empty()) {
+        return nullptr;
+    }
+    Delivery *msg = take_front(latency_stamp());
+    notify_space(m_space_listeners);
+    return msg;
+}
+
+// Remove all (or up to max_count) queued messages at once
+size_t MessageQueue::dequeue_batch(std::vector<Delivery *> &batch, size_t max_count) {
+    size_t count = 0;
+    uint64_t now = latency_stamp();
+    Guard guard(m_lock);
+    // Each message taken consumes one semaphore count, exactly as in
+    // try_dequeue (sem_trywait is a single atomic operation)
+    while (count < max_count && !m_messages.empty() && sem_trywait(&m_avail) == 0) {
+        batch.push_back(take_front(now));
+        count++;
+    }
+    if (count > 0) {
+        notify_space(m_space_listeners);
+    }
+    return count;
+}
+
+// Forget a producer that is no longer blocked on this queue
+void MessageQueue::cancel_space_listener(QueueListener *listener, uint64_t cookie) {
+    Guard guard(m_lock);
+    remove_space_listener(m_space_listeners, listener, cookie);
+}
+
+// Register the listener to notify when messages arrive
+void MessageQueue::set_listener(QueueListener *listener, uint64_t cookie) {
+    bool pending;
+    {
+        Guard guard(m_lock);
+        m_listener = listener;
+        m_cookie = cookie;
+        pending = !m_messages.empty();
+    }
+
+    // Messages that arrived before registration would otherwise go unnoticed
+    if (listener && pending) {
+        listener->on_message_available(cookie);
+    }
+}
+
+// Messages waiting
+size_t MessageQueue::get_depth() {
+    Guard guard(m_lock);
+    return m_messages.size();
+}
+
+// Create (once) and return the eventfd signalled when messages arrive
+int MessageQueue::get_wakeup_fd() {
+    Guard guard(m_lock);
+    if (m_wakefd < 0) {
+        m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        // Messages that arrived earlier would otherwise go unnoticed
+        if (m_wakefd >= 0 && !m_messages.empty()) {
+            signal_wakeup_fd(m_wakefd);
+        }
+    }
+    return m_wakefd;
+}
+
+#endif // MQUEUE_LOCKFREE
@@ -2,32 +2,224 @@
 #define MESSAGE_QUEUE_H
 
 #include <deque>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <cstdint>
 #include <pthread.h>
 #include <semaphore.h>
-struct Message;
+#include "pool.h"
+class Delivery;
 
-// This data type represents a queue of Messages waiting to
-// be delivered to a receiver
+// Something (such as an event loop) that wants to be told when
+// messages become available in a MessageQueue, rather than
+// blocking in dequeue
+class QueueListener {
+public:
+  virtual ~QueueListener() { }
+
+  // Called (without any queue lock held) when an enqueue makes
+  // an empty queue non-empty; cookie is the value passed to
+  // MessageQueue::set_listener
+  virtual void on_message_available(uint64_t cookie) = 0;
+
+  // Called on the consumer's thread when it takes messages from a full
+  // BLOCK queue that this listener was registered on by
+  // MessageQueue::enqueue; cookie is the value passed there. The queue
+  // is locked meanwhile, so this must not call back into it.
+  virtual void on_space_available(uint64_t cookie) { (void) cookie; }
+};
+
+// Bounds on what a MessageQueue may hold, and what happens to a
+// message that does not fit because its receiver has fallen behind
+struct QueueLimits {
+  enum Policy {
+    DROP_OLDEST, // discard queued messages to make room for it
+    DROP_NEWEST, // discard the message being enqueued
+    DISCONNECT,  // discard it and mark the queue overflowed, which makes
+                 // the receiver's session disconnect it
+    BLOCK,       // leave the message with the producer, which holds off
+                 // its sender until there is room (for up to
+                 // block_timeout_ms), then discards it
+  };
+
+  size_t max_messages;  // 0 means no limit
+  size_t max_bytes;     // encoded size of queued messages; 0 means no limit
+  Policy policy;
+  int block_timeout_ms; // BLOCK only
+
+  QueueLimits()
+    : max_messages(0)
+    , max_bytes(0)
+    , policy(DROP_OLDEST)
+    , block_timeout_ms(100) { }
+
+  bool is_bounded() const { return max_messages != 0 || max_bytes != 0; }
+};
+
+// This data type represents a queue of Deliveries waiting to
+// be delivered to a receiver. The queue owns one reference to each
+// Delivery it holds; dequeue hands that reference to the caller,
+// who must unref it when done.
+//
+// Any number of threads may enqueue, but only one thread (the
+// receiver's) may dequeue. Building with -DMQUEUE_LOCKFREE (make
+// MQUEUE=lockfree) selects a lock-free implementation of the same
+// interface, in message_queue_lockfree.cpp. (Producers can't remove
+// messages from that queue, so there DROP_OLDEST acts as DROP_NEWEST.)
 class MessageQueue {
 public:
-  MessageQueue();
+  // What enqueue did to respect the queue's limits
+  struct EnqueueResult {
+    unsigned dropped; // messages discarded (the new one, or older ones)
+    bool overflowed;  // this enqueue overflowed the queue (DISCONNECT)
+    bool blocked;     // the message was not taken (BLOCK, see enqueue)
+  };
+
+  MessageQueue(const QueueLimits &limits = QueueLimits());
   ~MessageQueue();
 
-  void enqueue(Message *msg); // will not block
-  Message *dequeue();         // blocks for at most a finite amount of time
+  // A queue made with new can be kept alive by others besides its
+  // owner (a producer holding a blocked message keeps a reference past
+  // its RCU read section). It starts with one reference, the owner's;
+  // unref deletes it once the last one is dropped.
+  void ref();
+  void unref();
+
+  const QueueLimits &get_limits() const { return m_limits; }
+
+  // Add a message, taking over the caller's reference. Never blocks.
+  // If the queue is full and its policy is BLOCK, the message is not
+  // taken: result.blocked is set, the caller keeps its reference, and
+  // space_listener is told once the consumer next takes messages, so
+  // the caller can try again. (Without a space_listener, BLOCK
+  // discards the message like DROP_NEWEST.)
+  EnqueueResult enqueue(Delivery *msg, QueueListener *space_listener = nullptr,
+                        uint64_t space_cookie = 0);
+
+  // Forget a space_listener registered by enqueue; once this returns
+  // it is not called. A listener must be cancelled before it goes away
+  // unless it has been told.
+  void cancel_space_listener(QueueListener *listener, uint64_t cookie);
+  Delivery *dequeue();         // blocks for at most a finite amount of time
+  Delivery *try_dequeue();     // never blocks, returns nullptr if empty
+
+  // Move up to max_count queued messages (by default, all of them) onto
+  // the end of batch without blocking, and return how many were moved.
+  // The caller owns a reference to each one.
+  size_t dequeue_batch(std::vector<Delivery *> &batch, size_t max_count = SIZE_MAX);
+
+  // Register (or, with nullptr, unregister) a listener to be notified
+  // when messages arrive. If the queue is already non-empty the
+  // listener is notified right away.
+  void set_listener(QueueListener *listener, uint64_t cookie);
+
+  // Return an eventfd (created on first call, closed by the destructor)
+  // that becomes readable when messages arrive, so the receiver can
+  // wait for messages and socket events together in poll. The receiver
+  // should read the eventfd to reset it, then try_dequeue until empty.
+  // Only the consumer may call this.
+  int get_wakeup_fd();
+
+  // True once a DISCONNECT queue has overflowed; the receiver should be
+  // disconnected. Listeners and the eventfd are notified when it happens.
+  bool is_overflowed() const { return m_overflowed.load(std::memory_order_acquire); }
+
+  // Number of messages waiting to be dequeued (any thread; for
+  // monitoring, since it may have changed by the time it is used)
+  size_t get_depth();
 
 private:
   // value semantics prohibited
   MessageQueue(const MessageQueue &);
   MessageQueue &operator=(const MessageQueue &);
 
+  static void signal_wakeup_fd(int fd);
+
+  // Producers waiting to be told that a full BLOCK queue has room
+  typedef std::vector<std::pair<QueueListener *, uint64_t>> SpaceListeners;
+  static void add_space_listener(SpaceListeners &listeners, QueueListener *listener,
+                                 uint64_t cookie);
+  static void remove_space_listener(SpaceListeners &listeners, QueueListener *listener,
+                                    uint64_t cookie);
+  static void notify_space(SpaceListeners &listeners);
+
+  // Would a message of the given size fit alongside count messages
+  // totalling bytes?
+  bool fits(size_t count, size_t bytes, size_t size) const;
+
+  const QueueLimits m_limits;
+  std::atomic<bool> m_overflowed;
+  std::atomic<unsigned> m_refs;
+
+#ifndef MQUEUE_LOCKFREE
   // these data members are sufficient to implement the
   // enqueue and dequeue operations: the idea is that the semaphore
   // keeps a count of how many messages are currently in the queue
 
   pthread_mutex_t m_lock; // must be held while accessing queue
   sem_t m_avail;
-  std::deque<Message *> m_messages;
+  // A queued message and when it was enqueued (latency_stamp), so the
+  // time it spends in the queue can be counted (see metrics.h)
+  struct Entry {
+    Delivery *msg;
+    uint64_t enqueued_ns;
+  };
+  std::deque<Entry, PoolAllocator<Entry>> m_messages; // nodes from the pool
+  QueueListener *m_listener; // protected by m_lock
+  uint64_t m_cookie;
+  int m_wakefd;              // protected by m_lock (-1 until requested)
+  size_t m_bytes;            // protected by m_lock: size of queued messages
+  SpaceListeners m_space_listeners; // protected by m_lock
+
+  bool make_room(size_t size, EnqueueResult &result);
+  Delivery *take_front(uint64_t now);
+#else
+  // The lock-free queue is a linked list of fixed-size segments.
+  // Producers claim a slot in the tail segment with an atomic
+  // increment and publish into it; the consumer walks slots in order.
+  // Only one allocation is needed per SEGMENT_SIZE messages.
+  static const unsigned SEGMENT_SIZE = 256;
+
+  struct Segment {
+    std::atomic<Delivery *> slots[SEGMENT_SIZE];
+    uint64_t stamps[SEGMENT_SIZE];  // when each slot was published
+    std::atomic<unsigned> reserved; // slots claimed by producers
+    std::atomic<Segment *> next;
+    Segment();
+
+    // Allocated by a producer and freed by the consumer, from the pool
+    static void *operator new(size_t size) { return pool_alloc(size); }
+    static void operator delete(void *ptr, size_t size) { pool_free(ptr, size); }
+  };
+
+  Delivery *take(uint64_t now);
+  void took_messages();
+  void retire(Segment *seg);
+  bool reserve(size_t size);
+
+  std::atomic<Segment *> m_tail;     // segment producers append to
+  std::atomic<unsigned> m_producers; // enqueues in progress
+  std::atomic<int> m_pending;        // published but not yet taken
+  std::atomic<size_t> m_count;       // bounded queues only: messages and
+  std::atomic<size_t> m_bytes;       // bytes reserved by producers
+  sem_t m_avail;                     // counts published messages
+
+  // BLOCK producers waiting for room; the count lets the consumer skip
+  // the lock when there are none
+  pthread_mutex_t m_space_lock;
+  SpaceListeners m_space_listeners;  // protected by m_space_lock
+  std::atomic<size_t> m_space_waiting;
+
+  // consumer-only state
+  Segment *m_head;
+  unsigned m_head_pos;
+  std::vector<Segment *> m_retired; // consumed, awaiting a safe free
+
+  std::atomic<QueueListener *> m_listener;
+  std::atomic<uint64_t> m_cookie;
+  std::atomic<int> m_wakefd;
+#endif
 };
 
-#endif // MESSAGE_QUEUE_H
\ No newline at end of file
+#endif // MESSAGE_QUEUE_H
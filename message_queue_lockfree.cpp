@@ -0,0 +1,348 @@
+#include <ctime>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "message_queue.h"
+#include "guard.h"
+#include "delivery.h"
+#include "metrics.h"
+
+// The lock-free queue, selected with -DMQUEUE_LOCKFREE.
+//
+// Producers never take a lock: an enqueue is an atomic increment to
+// claim a slot, a store to publish into it, and a sem_post (which only
+// makes a system call if the receiver is asleep in dequeue).
+//
+// Segments can't be freed as soon as the consumer is done with them,
+// because a producer may have just read m_tail and be about to claim
+// a slot in the old segment. So producers announce themselves in
+// m_producers before reading m_tail, and consumed segments are only
+// freed at a moment when no producer is in flight.
+#ifdef MQUEUE_LOCKFREE
+
+// Segments start out with every slot empty
+MessageQueue::Segment::Segment()
+  : reserved(0)
+  , next(nullptr) {
+    for (unsigned i = 0; i < SEGMENT_SIZE; i++) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+// Constructor for MessageQueue
+MessageQueue::MessageQueue(const QueueLimits &limits)
+  : m_limits(limits)
+  , m_overflowed(false)
+  , m_refs(1)
+  , m_tail(nullptr)
+  , m_producers(0)
+  , m_pending(0)
+  , m_count(0)
+  , m_bytes(0)
+  , m_space_waiting(0)
+  , m_head(new Segment())
+  , m_head_pos(0)
+  , m_listener(nullptr)
+  , m_cookie(0)
+  , m_wakefd(-1) {
+    m_tail.store(m_head);
+    pthread_mutex_init(&m_space_lock, nullptr);
+    // Initialize the semaphore to track available messages (starting with 0)
+    sem_init(&m_avail, 0, 0);
+}
+
+// Destructor for MessageQueue (no producers may be running)
+MessageQueue::~MessageQueue() {
+    // Drop the queue's references to undelivered messages
+    while (sem_trywait(&m_avail) == 0) {
+        take(0)->unref();
+    }
+
+    // Free the remaining segments
+    while (m_head) {
+        Segment *next = m_head->next.load();
+        delete m_head;
+        m_head = next;
+    }
+    for (Segment *seg : m_retired) {
+        delete seg;
+    }
+    if (m_wakefd.load() >= 0) {
+        close(m_wakefd.load());
+    }
+    pthread_mutex_destroy(&m_space_lock);
+    sem_destroy(&m_avail);
+}
+
+// Claim room for a message in a bounded queue. Returns true if the
+// message may be published.
+bool MessageQueue::reserve(size_t size) {
+    if (m_overflowed.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    // Reserve optimistically, and back out if that went over
+    size_t count = m_count.fetch_add(1);
+    size_t bytes = m_bytes.fetch_add(size);
+    if (fits(count, bytes, size)) {
+        return true;
+    }
+    m_count.fetch_sub(1);
+    m_bytes.fetch_sub(size);
+    return false;
+}
+
+// Add a message to the queue
+MessageQueue::EnqueueResult MessageQueue::enqueue(Delivery *msg, QueueListener *space_listener,
+                                                  uint64_t space_cookie) {
+    EnqueueResult result = { 0, false, false };
+    if (m_limits.is_bounded()) {
+        size_t size = msg->get_wire_len(false);
+        bool reserved = reserve(size);
+        if (!reserved && m_limits.policy == QueueLimits::BLOCK && space_listener &&
+            !m_overflowed.load(std::memory_order_relaxed)) {
+            // The producer keeps the message, to try again once the
+            // consumer has taken some. Registering and then trying once
+            // more pairs with took_messages (both sides write, then read
+            // the other's counter, all sequentially consistent), so room
+            // made in between is never missed.
+            {
+                Guard guard(m_space_lock);
+                add_space_listener(m_space_listeners, space_listener, space_cookie);
+                m_space_waiting.store(m_space_listeners.size());
+            }
+            reserved = reserve(size);
+            if (!reserved) {
+                result.blocked = true;
+                return result;
+            }
+            cancel_space_listener(space_listener, space_cookie);
+        }
+        // Producers can't remove queued messages, so DROP_OLDEST drops
+        // the new message just like DROP_NEWEST (and so does BLOCK
+        // without a space_listener)
+        if (!reserved) {
+            msg->unref();
+            result.dropped = 1;
+            // Only the enqueue that overflowed the queue reports it, and
+            // wakes the receiver so it notices
+            if (m_limits.policy == QueueLimits::DISCONNECT) {
+                result.overflowed = !m_overflowed.exchange(true);
+            }
+            if (result.overflowed) {
+                QueueListener *listener = m_listener.load();
+                if (listener) {
+                    listener->on_message_available(m_cookie.load());
+                }
+                int wakefd = m_wakefd.load();
+                if (wakefd >= 0) {
+                    signal_wakeup_fd(wakefd);
+                }
+            }
+            return result;
+        }
+    }
+
+    uint64_t ingress_ns = msg->get_ingress_ns(); // (msg may be gone once published)
+    uint64_t enqueued_ns = latency_stamp();
+
+    // Announce ourselves before reading m_tail (see retire)
+    m_producers.fetch_add(1);
+
+    Segment *seg = m_tail.load();
+    while (true) {
+        // Claim a slot; if the segment is full, move to the next one
+        unsigned pos = seg->reserved.fetch_add(1, std::memory_order_relaxed);
+        if (pos < SEGMENT_SIZE) {
+            seg->stamps[pos] = enqueued_ns; // published along with msg
+            seg->slots[pos].store(msg, std::memory_order_release);
+            break;
+        }
+
+        // Link a new segment unless another producer already did
+        Segment *next = seg->next.load(std::memory_order_acquire);
+        if (!next) {
+            Segment *fresh = new Segment();
+            if (seg->next.compare_exchange_strong(next, fresh)) {
+                next = fresh;
+            } else {
+                delete fresh; // lost the race, next is the winner's segment
+            }
+        }
+
+        // Help move the tail along (fails harmlessly if already moved)
+        Segment *expected = seg;
+        m_tail.compare_exchange_strong(expected, next);
+        seg = next;
+    }
+
+    m_producers.fetch_sub(1, std::memory_order_release);
+    if (enqueued_ns != 0 && ingress_ns != 0) {
+        latency_record(LATENCY_INGRESS_TO_ENQUEUE, enqueued_ns - ingress_ns);
+    }
+
+    // Increment the semaphore to indicate a new message is available
+    sem_post(&m_avail);
+
+    // Only the empty -> non-empty transition needs a notification
+    if (m_pending.fetch_add(1) == 0) {
+        QueueListener *listener = m_listener.load();
+        if (listener) {
+            listener->on_message_available(m_cookie.load());
+        }
+        int wakefd = m_wakefd.load();
+        if (wakefd >= 0) {
+            signal_wakeup_fd(wakefd);
+        }
+    }
+    return result;
+}
+
+// Remove and return a message from the queue
+Delivery *MessageQueue::dequeue() {
+    // Set up a timeout of 1 second for the semaphore wait
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;  // Set timeout to 1 second from now
+
+    // Wait for a message to be available, with timeout
+    if (sem_timedwait(&m_avail, &ts) != 0) {
+        // Return nullptr if timeout occurs
+        return nullptr;
+    }
+    Delivery *msg = take(latency_stamp());
+    took_messages();
+    return msg;
+}
+
+// Remove and return a message from the queue without waiting
+Delivery *MessageQueue::try_dequeue() {
+    // Consume a semaphore count only if one is available
+    if (sem_trywait(&m_avail) != 0) {
+        return nullptr;
+    }
+    Delivery *msg = take(latency_stamp());
+    took_messages();
+    return msg;
+}
+
+// Remove all (or up to max_count) queued messages at once
+size_t MessageQueue::dequeue_batch(std::vector<Delivery *> &batch, size_t max_count) {
+    size_t count = 0;
+    uint64_t now = latency_stamp();
+    while (count < max_count && sem_trywait(&m_avail) == 0) {
+        batch.push_back(take(now));
+        count++;
+    }
+    if (count > 0) {
+        took_messages();
+    }
+    return count;
+}
+
+// Tell any BLOCK producers waiting for room that the consumer has just
+// taken messages (see enqueue)
+void MessageQueue::took_messages() {
+    if (m_space_waiting.load() == 0) {
+        return;
+    }
+    Guard guard(m_space_lock);
+    notify_space(m_space_listeners);
+    m_space_waiting.store(0);
+}
+
+// Forget a producer that is no longer blocked on this queue
+void MessageQueue::cancel_space_listener(QueueListener *listener, uint64_t cookie) {
+    Guard guard(m_space_lock);
+    remove_space_listener(m_space_listeners, listener, cookie);
+    m_space_waiting.store(m_space_listeners.size());
+}
+
+// Register the listener to notify when messages arrive
+void MessageQueue::set_listener(QueueListener *listener, uint64_t cookie) {
+    m_cookie.store(cookie);
+    m_listener.store(listener);
+
+    // Messages that arrived before registration would otherwise go
+    // unnoticed (a racing producer may notify too, which is harmless)
+    if (listener && m_pending.load() > 0) {
+        listener->on_message_available(cookie);
+    }
+}
+
+// Messages published and not yet taken
+size_t MessageQueue::get_depth() {
+    int pending = m_pending.load(std::memory_order_relaxed);
+    return pending > 0 ? pending : 0;
+}
+
+// Create (once) and return the eventfd signalled when messages arrive
+int MessageQueue::get_wakeup_fd() {
+    if (m_wakefd.load() < 0) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_wakefd.store(fd);
+        // Messages that arrived earlier would otherwise go unnoticed
+        // (a racing producer may signal too, which is harmless)
+        if (fd >= 0 && m_pending.load() > 0) {
+            signal_wakeup_fd(fd);
+        }
+    }
+    return m_wakefd.load();
+}
+
+// Take the next message, which the caller has already claimed by
+// decrementing m_avail, so one is known to have been published. Its
+// time in the queue is counted unless it or now (a latency_stamp) is 0.
+Delivery *MessageQueue::take(uint64_t now) {
+    while (true) {
+        if (m_head_pos == SEGMENT_SIZE) {
+            // Move to the next segment; it exists, since the message we
+            // claimed was published beyond this one
+            Segment *next = m_head->next.load(std::memory_order_acquire);
+            if (!next) {
+                sched_yield();
+                continue;
+            }
+            retire(m_head);
+            m_head = next;
+            m_head_pos = 0;
+        }
+
+        // A producer that claimed this slot before the one whose message
+        // we were promised may not have stored into it yet
+        Delivery *msg = m_head->slots[m_head_pos].load(std::memory_order_acquire);
+        if (!msg) {
+            sched_yield();
+            continue;
+        }
+        uint64_t enqueued_ns = m_head->stamps[m_head_pos];
+        if (now != 0 && enqueued_ns != 0) {
+            latency_record(LATENCY_QUEUE_RESIDENCY, now - enqueued_ns);
+        }
+        m_head_pos++;
+        m_pending.fetch_sub(1);
+        if (m_limits.is_bounded()) {
+            m_count.fetch_sub(1);
+            m_bytes.fetch_sub(msg->get_wire_len(false));
+        }
+        return msg;
+    }
+}
+
+// Free consumed segments once no producer can still be using them
+void MessageQueue::retire(Segment *seg) {
+    m_retired.push_back(seg);
+
+    // m_tail is always at or past the segment any message was published
+    // in, so it has already moved past every retired segment. Producers
+    // read m_tail only after incrementing m_producers, so once no
+    // producer is in flight nobody can reach a retired segment again.
+    if (m_producers.load() != 0) {
+        return;
+    }
+    for (Segment *old : m_retired) {
+        delete old;
+    }
+    m_retired.clear();
+}
+
+#endif // MQUEUE_LOCKFREE
@@ -0,0 +1,157 @@
+#include <vector>
+#include <cstring>
+#include <pthread.h>
+#include "guard.h"
+#include "metrics.h"
+
+const char *const METRIC_NAMES[NUM_METRICS] = {
+    "connections_opened",
+    "connections_closed",
+    "messages_in",
+    "messages_out",
+    "bytes_in",
+    "bytes_out",
+};
+
+const char *const LATENCY_NAMES[NUM_LATENCY_STAGES] = {
+    "latency_ingress_to_enqueue",
+    "latency_queue_residency",
+    "latency_write",
+    "latency_end_to_end",
+};
+
+thread_local MetricsBlock *t_metrics = nullptr;
+std::atomic<bool> g_latency_enabled(false);
+
+namespace {
+    pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<MetricsBlock *> g_blocks; // live threads' blocks, under g_lock
+    MetricsTotals g_exited;               // counts of threads that have exited
+
+    // Histogram buckets, under g_lock: those of threads that have
+    // exited, and the totals at the last latency_reset
+    typedef uint64_t Histograms[NUM_LATENCY_STAGES][LATENCY_BUCKETS];
+    Histograms g_exited_latency;
+    Histograms g_latency_base;
+
+    pthread_key_t g_block_key;
+    pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+
+    // Thread exit: keep its counts and free the block
+    void release_block(void *arg) {
+        MetricsBlock *block = static_cast<MetricsBlock *>(arg);
+        Guard guard(g_lock);
+        for (unsigned i = 0; i < NUM_METRICS; i++) {
+            g_exited.counts[i] += block->counts[i].load(std::memory_order_relaxed);
+        }
+        for (unsigned stage = 0; stage < NUM_LATENCY_STAGES; stage++) {
+            for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+                g_exited_latency[stage][i] += block->latency[stage][i].load(std::memory_order_relaxed);
+            }
+        }
+        for (size_t i = 0; i < g_blocks.size(); i++) {
+            if (g_blocks[i] == block) {
+                g_blocks[i] = g_blocks.back();
+                g_blocks.pop_back();
+                break;
+            }
+        }
+        t_metrics = nullptr;
+        delete block;
+    }
+
+    void create_key() {
+        pthread_key_create(&g_block_key, release_block);
+    }
+
+    // Every thread's buckets added up (g_lock must be held)
+    void sum_latency(Histograms &totals) {
+        memcpy(totals, g_exited_latency, sizeof(Histograms));
+        for (MetricsBlock *block : g_blocks) {
+            for (unsigned stage = 0; stage < NUM_LATENCY_STAGES; stage++) {
+                for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+                    totals[stage][i] += block->latency[stage][i].load(std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+}
+
+// This thread's block, created the first time it counts something
+MetricsBlock *metrics_register_thread() {
+    if (!t_metrics) {
+        pthread_once(&g_key_once, create_key);
+        MetricsBlock *block = new MetricsBlock(); // zeroed
+        pthread_setspecific(g_block_key, block);
+        {
+            Guard guard(g_lock);
+            g_blocks.push_back(block);
+        }
+        t_metrics = block;
+    }
+    return t_metrics;
+}
+
+uint64_t latency_percentile(const uint64_t *buckets, uint64_t count, unsigned permille) {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0) {
+            return latency_bucket_max(i);
+        }
+    }
+    return latency_bucket_max(LATENCY_BUCKETS - 1);
+}
+
+MetricsTotals metrics_get() {
+    Guard guard(g_lock);
+    MetricsTotals totals = g_exited;
+    for (MetricsBlock *block : g_blocks) {
+        for (unsigned i = 0; i < NUM_METRICS; i++) {
+            totals.counts[i] += block->counts[i].load(std::memory_order_relaxed);
+        }
+    }
+    return totals;
+}
+
+void latency_get(LatencySummary summaries[NUM_LATENCY_STAGES]) {
+    static Histograms totals; // (too big for the stack of a small thread)
+    Guard guard(g_lock);
+    sum_latency(totals);
+    for (unsigned stage = 0; stage < NUM_LATENCY_STAGES; stage++) {
+        uint64_t *buckets = totals[stage];
+        uint64_t count = 0;
+        unsigned last = 0;
+        for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+            buckets[i] -= g_latency_base[stage][i];
+            count += buckets[i];
+            if (buckets[i] > 0) {
+                last = i;
+            }
+        }
+
+        LatencySummary &summary = summaries[stage];
+        summary.count = count;
+        if (count == 0) {
+            summary.p50 = summary.p99 = summary.p999 = summary.max = 0;
+            continue;
+        }
+        summary.p50 = latency_percentile(buckets, count, 500);
+        summary.p99 = latency_percentile(buckets, count, 990);
+        summary.p999 = latency_percentile(buckets, count, 999);
+        summary.max = latency_bucket_max(last);
+    }
+}
+
+void latency_set_enabled(bool enabled) {
+    g_latency_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void latency_reset() {
+    Guard guard(g_lock);
+    sum_latency(g_latency_base);
+}
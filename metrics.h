@@ -0,0 +1,143 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+// Server-wide traffic counters and latency histograms, kept per thread.
+//
+// Every thread that counts something gets its own block of counters
+// (created the first time it counts, on a cache line of its own), so
+// counting is a plain load and store to memory no other thread writes:
+// no lock, no atomic read-modify-write and no cache line bouncing
+// between cores. metrics_get adds up every thread's block when the
+// totals are wanted, which is rare (see admin.h).
+
+enum Metric {
+  METRIC_CONNECTIONS_OPENED, // clients accepted
+  METRIC_CONNECTIONS_CLOSED, // client sessions cleaned up
+  METRIC_MESSAGES_IN,        // messages received (commands, logins, joins)
+  METRIC_MESSAGES_OUT,       // messages sent (replies and deliveries)
+  METRIC_BYTES_IN,           // bytes read from sockets
+  METRIC_BYTES_OUT,          // bytes written to sockets
+  NUM_METRICS
+};
+
+// Names used when the totals are reported
+extern const char *const METRIC_NAMES[NUM_METRICS];
+
+// The stages of a broadcast message's trip from its sender's socket to
+// a receiver's, each timed per receiver in nanoseconds (latency_now).
+// Only live deliveries are timed, not ones replayed from history.
+enum LatencyStage {
+  LATENCY_INGRESS_TO_ENQUEUE, // read from the sender's socket -> in the queue
+  LATENCY_QUEUE_RESIDENCY,    // in the queue -> taken by the receiver
+  LATENCY_WRITE,              // taken -> handed to the receiver's socket
+                              // (or its Connection's output buffer)
+  LATENCY_END_TO_END,         // read from the sender's socket -> written
+  NUM_LATENCY_STAGES
+};
+
+extern const char *const LATENCY_NAMES[NUM_LATENCY_STAGES];
+
+// HDR-style histogram buckets: values below LATENCY_SUB_BUCKETS get a
+// bucket each, and every power of two above that is split into
+// LATENCY_SUB_BUCKETS equal buckets, so a value is known to within
+// about 3% however large it is. Values are capped at 2^36ns (~69s).
+const unsigned LATENCY_SUB_BUCKET_BITS = 5;
+const unsigned LATENCY_SUB_BUCKETS = 1u << LATENCY_SUB_BUCKET_BITS;
+const unsigned LATENCY_MAX_BITS = 36;
+const unsigned LATENCY_BUCKETS = (LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS;
+
+inline unsigned latency_bucket(uint64_t ns) {
+  if (ns >= (1ull << LATENCY_MAX_BITS)) {
+    ns = (1ull << LATENCY_MAX_BITS) - 1;
+  }
+  if (ns < LATENCY_SUB_BUCKETS) {
+    return (unsigned) ns;
+  }
+  unsigned shift = (63 - __builtin_clzll(ns)) - LATENCY_SUB_BUCKET_BITS;
+  return (shift + 1) * LATENCY_SUB_BUCKETS + (unsigned) ((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// The largest value that falls in a bucket
+inline uint64_t latency_bucket_max(unsigned bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) {
+    return bucket;
+  }
+  unsigned shift = bucket / LATENCY_SUB_BUCKETS - 1;
+  uint64_t lowest = (uint64_t) (LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+  return lowest + (1ull << shift) - 1;
+}
+
+// The value ranked ceil(count * permille / 1000) (at least 1) in a
+// histogram of LATENCY_BUCKETS buckets holding count values, as the
+// upper bound of its bucket (0 if count is 0)
+uint64_t latency_percentile(const uint64_t *buckets, uint64_t count, unsigned permille);
+
+// One thread's counters. Only the owning thread writes them; they are
+// atomic so metrics_get can read them from another thread.
+struct MetricsBlock {
+  char pad_before[64];
+  std::atomic<uint64_t> counts[NUM_METRICS];
+  std::atomic<uint64_t> latency[NUM_LATENCY_STAGES][LATENCY_BUCKETS];
+  char pad_after[64];
+};
+
+// This thread's block (registered on first use)
+MetricsBlock *metrics_register_thread();
+extern thread_local MetricsBlock *t_metrics;
+
+inline void metrics_add(Metric metric, uint64_t n = 1) {
+  MetricsBlock *block = t_metrics ? t_metrics : metrics_register_thread();
+  std::atomic<uint64_t> &count = block->counts[metric];
+  count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Totals over all threads, including ones that have exited
+struct MetricsTotals {
+  uint64_t counts[NUM_METRICS];
+};
+
+MetricsTotals metrics_get();
+
+// Monotonic clock in nanoseconds, for latency timestamps
+inline uint64_t latency_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Timing costs a few clock reads per delivery, so it is off until
+// something will report it (the admin endpoint turns it on)
+extern std::atomic<bool> g_latency_enabled;
+
+void latency_set_enabled(bool enabled);
+
+// A timestamp, or 0 (which is never timed) when timing is off
+inline uint64_t latency_stamp() {
+  return g_latency_enabled.load(std::memory_order_relaxed) ? latency_now() : 0;
+}
+
+// Count one message that took ns nanoseconds in a stage
+inline void latency_record(LatencyStage stage, uint64_t ns) {
+  MetricsBlock *block = t_metrics ? t_metrics : metrics_register_thread();
+  std::atomic<uint64_t> &count = block->latency[stage][latency_bucket(ns)];
+  count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// Percentiles of one stage since the last reset (each is the upper
+// bound of the bucket it falls in; all zero if nothing was counted)
+struct LatencySummary {
+  uint64_t count;
+  uint64_t p50, p99, p999, max;
+};
+
+void latency_get(LatencySummary summaries[NUM_LATENCY_STAGES]);
+
+// Start the histograms over (what was counted so far is remembered and
+// subtracted, since only their owners may write to them)
+void latency_reset();
+
+#endif // METRICS_H
@@ -0,0 +1,234 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include "guard.h"
+#include "pool.h"
+
+namespace {
+    // Size classes POOL_MIN_BLOCK << i
+    const unsigned NUM_CLASSES = 9;
+    static_assert(POOL_MIN_BLOCK << (NUM_CLASSES - 1) == POOL_MAX_BLOCK,
+                  "size classes must end at POOL_MAX_BLOCK");
+
+    // New blocks are carved out of chunks of this many bytes
+    const size_t CHUNK_SIZE = 64 * 1024;
+
+    // A free block holds the link to the next one
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    // A list of free blocks handed between a thread and the depot
+    struct Batch {
+        FreeBlock *head;
+        unsigned count;
+    };
+
+    // The part of a chunk whose blocks have not been handed out yet
+    struct Region {
+        char *next;
+        char *end;
+    };
+
+    // One thread's free lists and counters. The counters are only
+    // written by the owning thread (so a plain store will do), and are
+    // atomic so pool_get_stats can read them from another thread.
+    struct Cache {
+        FreeBlock *lists[NUM_CLASSES];
+        unsigned counts[NUM_CLASSES];
+        Region carved[NUM_CLASSES]; // blocks are cut off the front as needed
+        std::atomic<uint64_t> allocs, reused, fresh, large, frees, refills, spills;
+
+        Cache() : lists(), counts(), carved(), allocs(0), reused(0), fresh(0), large(0),
+                  frees(0), refills(0), spills(0) { }
+    };
+
+    // Shared between all threads, under g_lock
+    pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<Batch> g_depot[NUM_CLASSES];
+    std::vector<Region> g_leftover[NUM_CLASSES]; // exited threads' carved regions
+    std::vector<Cache *> g_caches;       // live threads' caches
+    PoolStats g_exited;                  // counts of threads that have exited
+
+    pthread_key_t g_cache_key;
+    pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+    thread_local Cache *t_cache = nullptr;
+
+    void bump(std::atomic<uint64_t> &counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    unsigned size_class(size_t size) {
+        unsigned cls = 0;
+        while ((POOL_MIN_BLOCK << cls) < size) {
+            cls++;
+        }
+        return cls;
+    }
+
+    // Take up to count blocks off a free list as a batch
+    Batch take_batch(FreeBlock *&list, unsigned &list_count, unsigned count) {
+        Batch batch = { list, 0 };
+        FreeBlock *last = nullptr;
+        while (list && batch.count < count) {
+            last = list;
+            list = list->next;
+            batch.count++;
+        }
+        if (last) {
+            last->next = nullptr;
+        }
+        list_count -= batch.count;
+        return batch;
+    }
+
+    // Thread exit: give the free lists to the depot and keep the counts
+    void release_cache(void *arg) {
+        Cache *cache = static_cast<Cache *>(arg);
+        Guard guard(g_lock);
+        for (unsigned cls = 0; cls < NUM_CLASSES; cls++) {
+            if (cache->lists[cls]) {
+                g_depot[cls].push_back(take_batch(cache->lists[cls], cache->counts[cls], UINT32_MAX));
+            }
+            if (cache->carved[cls].next != cache->carved[cls].end) {
+                g_leftover[cls].push_back(cache->carved[cls]);
+            }
+        }
+        g_exited.allocs += cache->allocs;
+        g_exited.reused += cache->reused;
+        g_exited.fresh += cache->fresh;
+        g_exited.large += cache->large;
+        g_exited.frees += cache->frees;
+        g_exited.refills += cache->refills;
+        g_exited.spills += cache->spills;
+        for (size_t i = 0; i < g_caches.size(); i++) {
+            if (g_caches[i] == cache) {
+                g_caches[i] = g_caches.back();
+                g_caches.pop_back();
+                break;
+            }
+        }
+        t_cache = nullptr;
+        delete cache;
+    }
+
+    void create_key() {
+        pthread_key_create(&g_cache_key, release_cache);
+    }
+
+    // This thread's cache, created the first time it allocates
+    Cache *get_cache() {
+        if (!t_cache) {
+            pthread_once(&g_key_once, create_key);
+            t_cache = new Cache();
+            pthread_setspecific(g_cache_key, t_cache);
+            Guard guard(g_lock);
+            g_caches.push_back(t_cache);
+        }
+        return t_cache;
+    }
+
+    // Called with an empty free list and nothing left to carve: take a
+    // batch of freed blocks from the depot if there is one, otherwise a
+    // region to carve, left by an exited thread or cut from a new chunk
+    void refill(Cache *cache, unsigned cls) {
+        {
+            Guard guard(g_lock);
+            if (!g_depot[cls].empty()) {
+                Batch batch = g_depot[cls].back();
+                g_depot[cls].pop_back();
+                cache->lists[cls] = batch.head;
+                cache->counts[cls] = batch.count;
+                bump(cache->refills);
+                return;
+            }
+            if (!g_leftover[cls].empty()) {
+                cache->carved[cls] = g_leftover[cls].back();
+                g_leftover[cls].pop_back();
+                return;
+            }
+        }
+
+        size_t block_size = POOL_MIN_BLOCK << cls;
+        size_t num_blocks = CHUNK_SIZE / block_size;
+        char *chunk = static_cast<char *>(malloc(num_blocks * block_size));
+        if (!chunk) {
+            throw std::bad_alloc();
+        }
+        cache->carved[cls].next = chunk;
+        cache->carved[cls].end = chunk + num_blocks * block_size;
+    }
+}
+
+void *pool_alloc(size_t size) {
+    Cache *cache = get_cache();
+    bump(cache->allocs);
+    if (size > POOL_MAX_BLOCK) {
+        bump(cache->large);
+        void *ptr = malloc(size);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    // Blocks that were freed before go out first, then new ones
+    unsigned cls = size_class(size);
+    Region &carved = cache->carved[cls];
+    if (!cache->lists[cls] && carved.next == carved.end) {
+        refill(cache, cls);
+    }
+    if (cache->lists[cls]) {
+        bump(cache->reused);
+        FreeBlock *block = cache->lists[cls];
+        cache->lists[cls] = block->next;
+        cache->counts[cls]--;
+        return block;
+    }
+    bump(cache->fresh);
+    void *block = carved.next;
+    carved.next += POOL_MIN_BLOCK << cls;
+    return block;
+}
+
+void pool_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    Cache *cache = get_cache();
+    bump(cache->frees);
+    if (size > POOL_MAX_BLOCK) {
+        free(ptr);
+        return;
+    }
+
+    unsigned cls = size_class(size);
+    FreeBlock *block = static_cast<FreeBlock *>(ptr);
+    block->next = cache->lists[cls];
+    cache->lists[cls] = block;
+
+    // Too many cached: keep half, give the rest to other threads
+    if (++cache->counts[cls] > POOL_CACHE_BLOCKS) {
+        Batch batch = take_batch(cache->lists[cls], cache->counts[cls], POOL_CACHE_BLOCKS / 2);
+        bump(cache->spills);
+        Guard guard(g_lock);
+        g_depot[cls].push_back(batch);
+    }
+}
+
+PoolStats pool_get_stats() {
+    Guard guard(g_lock);
+    PoolStats stats = g_exited;
+    for (Cache *cache : g_caches) {
+        stats.allocs += cache->allocs.load(std::memory_order_relaxed);
+        stats.reused += cache->reused.load(std::memory_order_relaxed);
+        stats.fresh += cache->fresh.load(std::memory_order_relaxed);
+        stats.large += cache->large.load(std::memory_order_relaxed);
+        stats.frees += cache->frees.load(std::memory_order_relaxed);
+        stats.refills += cache->refills.load(std::memory_order_relaxed);
+        stats.spills += cache->spills.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
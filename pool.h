@@ -0,0 +1,67 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// Thread-caching pool allocator for the objects every broadcast
+// allocates (Deliveries, and message queue nodes).
+//
+// Blocks come in power-of-two size classes from POOL_MIN_BLOCK to
+// POOL_MAX_BLOCK bytes; larger requests go straight to malloc. Each
+// thread keeps a free list per size class, so an allocation or free is
+// normally a few pointer operations with no lock and no atomic
+// read-modify-write. A Delivery is usually freed by a different thread
+// from the one that allocated it (the last receiver to send it), so a
+// thread whose list grows past POOL_CACHE_BLOCKS hands half of it to a
+// shared depot, and a thread whose list is empty takes a batch from
+// the depot before asking malloc for new blocks. Blocks are never
+// returned to malloc.
+
+const size_t POOL_MIN_BLOCK = 32;
+const size_t POOL_MAX_BLOCK = 8192;
+const unsigned POOL_CACHE_BLOCKS = 256;
+
+// Counts are summed over all threads (including ones that have exited)
+// when read, so they are only approximately consistent with each other.
+//
+// Every allocation is counted once: allocs == reused + fresh + large.
+struct PoolStats {
+  uint64_t allocs;       // blocks handed out (all sizes)
+  uint64_t reused;       // ...that had been freed before
+  uint64_t fresh;        // ...handed out for the first time, carved out of new memory
+  uint64_t large;        // ...too large for the pool (malloc)
+  uint64_t frees;        // blocks given back
+  uint64_t refills;      // batches taken from the depot
+  uint64_t spills;       // batches handed to the depot
+};
+
+// Allocate size bytes (aligned for any type); never returns nullptr
+void *pool_alloc(size_t size);
+
+// Free a block from pool_alloc; size must be the size it was asked for
+void pool_free(void *ptr, size_t size);
+
+PoolStats pool_get_stats();
+
+// Standard allocator over the pool, for containers such as the
+// MessageQueue's std::deque
+template<typename T>
+struct PoolAllocator {
+  typedef T value_type;
+
+  PoolAllocator() { }
+  template<typename U>
+  PoolAllocator(const PoolAllocator<U> &) { }
+
+  T *allocate(size_t n) { return static_cast<T *>(pool_alloc(n * sizeof(T))); }
+  void deallocate(T *ptr, size_t n) { pool_free(ptr, n * sizeof(T)); }
+};
+
+template<typename T, typename U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) { return true; }
+template<typename T, typename U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) { return false; }
+
+#endif // POOL_H
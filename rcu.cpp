@@ -0,0 +1,146 @@
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+#include "guard.h"
+#include "rcu.h"
+
+// There is a global epoch counter. A reader announces the epoch it saw
+// when it entered its critical section in its thread's record. The
+// epoch may only advance once every active reader has announced the
+// current epoch, so two advances after an object was retired, no
+// reader that could have seen it is still active.
+
+namespace {
+    // Per-thread announcement, linked into a global list. Records are
+    // never freed; a record released by an exiting thread is reused.
+    struct ThreadRecord {
+        std::atomic<uint64_t> epoch;  // 0 when not in a critical section
+        std::atomic<bool> in_use;
+        ThreadRecord *next;
+    };
+
+    // An object waiting for its grace period
+    struct Retired {
+        void (*fn)(void *);
+        void *ptr;
+        uint64_t epoch; // global epoch when it was retired
+    };
+
+    std::atomic<uint64_t> g_epoch(1);
+    std::atomic<ThreadRecord *> g_records(nullptr);
+
+    pthread_mutex_t g_retire_lock = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<Retired> g_retired; // protected by g_retire_lock
+
+    pthread_key_t g_record_key;
+    pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+
+    thread_local ThreadRecord *t_record = nullptr;
+    thread_local unsigned t_nesting = 0;
+
+    // Thread exit: give the record back for reuse
+    void release_record(void *arg) {
+        ThreadRecord *rec = static_cast<ThreadRecord *>(arg);
+        rec->epoch.store(0);
+        rec->in_use.store(false);
+    }
+
+    void create_key() {
+        pthread_key_create(&g_record_key, release_record);
+    }
+
+    // Find (or make) this thread's record
+    ThreadRecord *get_record() {
+        if (t_record) {
+            return t_record;
+        }
+        pthread_once(&g_key_once, create_key);
+
+        // Reuse a record from a thread that has exited...
+        ThreadRecord *rec;
+        for (rec = g_records.load(); rec; rec = rec->next) {
+            bool expected = false;
+            if (!rec->in_use.load() && rec->in_use.compare_exchange_strong(expected, true)) {
+                break;
+            }
+        }
+
+        // ...or push a new one onto the list
+        if (!rec) {
+            rec = new ThreadRecord;
+            rec->epoch.store(0);
+            rec->in_use.store(true);
+            rec->next = g_records.load();
+            while (!g_records.compare_exchange_weak(rec->next, rec)) {
+                // rec->next was updated to the current head, try again
+            }
+        }
+
+        pthread_setspecific(g_record_key, rec);
+        t_record = rec;
+        return rec;
+    }
+
+    // Advance the global epoch if every active reader has seen it
+    bool try_advance() {
+        uint64_t epoch = g_epoch.load();
+        for (ThreadRecord *rec = g_records.load(); rec; rec = rec->next) {
+            uint64_t seen = rec->epoch.load();
+            if (seen != 0 && seen != epoch) {
+                return false; // a reader is still in an older epoch
+            }
+        }
+        g_epoch.compare_exchange_strong(epoch, epoch + 1);
+        return true;
+    }
+}
+
+// Enter a read-side critical section
+void rcu_read_lock() {
+    ThreadRecord *rec = get_record();
+    if (t_nesting++ == 0) {
+        rec->epoch.store(g_epoch.load(), std::memory_order_relaxed);
+        // The announcement must be visible before we read any
+        // RCU-protected pointer
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+// Leave a read-side critical section
+void rcu_read_unlock() {
+    if (--t_nesting == 0) {
+        t_record->epoch.store(0, std::memory_order_release);
+    }
+}
+
+// Defer fn(ptr) until the grace period has passed
+void rcu_retire(void (*fn)(void *), void *ptr) {
+    std::vector<Retired> ready;
+    {
+        Guard guard(g_retire_lock);
+        g_retired.push_back(Retired{fn, ptr, g_epoch.load()});
+
+        // With no readers in the way, two advances free it right away
+        if (try_advance()) {
+            try_advance();
+        }
+
+        // Anything retired two or more epochs ago is safe to free
+        uint64_t epoch = g_epoch.load();
+        size_t kept = 0;
+        for (size_t i = 0; i < g_retired.size(); i++) {
+            if (g_retired[i].epoch + 2 <= epoch) {
+                ready.push_back(g_retired[i]);
+            } else {
+                g_retired[kept++] = g_retired[i];
+            }
+        }
+        g_retired.resize(kept);
+    }
+
+    // Run the callbacks without holding the lock
+    for (const Retired &item : ready) {
+        item.fn(item.ptr);
+    }
+}
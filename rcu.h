@@ -0,0 +1,45 @@
+#ifndef RCU_H
+#define RCU_H
+
+// Epoch-based read-copy-update (RCU).
+//
+// Shared data that is read far more often than it changes (such as a
+// room's member list) can be published as an immutable object through
+// an atomic pointer. Readers bracket their use of the object with an
+// RcuReadGuard and never block. A writer builds a new version, swaps
+// the pointer, and hands the old version to rcu_retire, which frees it
+// only after every reader that might still be using it has finished.
+//
+// Read-side sections should be short and must not block, since they
+// hold back reclamation of everything retired meanwhile.
+
+// Enter/leave a read-side critical section (these nest)
+void rcu_read_lock();
+void rcu_read_unlock();
+
+// Arrange for fn(ptr) to be called once no reader can still hold ptr.
+// It may be called from within this function, or from a later call to
+// rcu_retire on any thread.
+void rcu_retire(void (*fn)(void *), void *ptr);
+
+// Convenience wrapper to delete an object once it is safe to do so
+template<typename T>
+void rcu_retire_delete(T *ptr) {
+  struct Deleter {
+    static void destroy(void *p) { delete static_cast<T *>(p); }
+  };
+  rcu_retire(Deleter::destroy, ptr);
+}
+
+// Scoped read-side critical section, in the style of Guard
+class RcuReadGuard {
+public:
+  RcuReadGuard() { rcu_read_lock(); }
+  ~RcuReadGuard() { rcu_read_unlock(); }
+
+private:
+  RcuReadGuard(const RcuReadGuard &);
+  RcuReadGuard &operator=(const RcuReadGuard &);
+};
+
+#endif // RCU_H
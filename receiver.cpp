@@ -8,9 +8,29 @@
 #include "client_util.h"
 
 int main(int argc, char **argv) {
+  // -b asks the server for the binary protocol; -n N and -s SEQ ask
+  // for the room's last N messages, or those from SEQ on, to be
+  // replayed before the live ones
+  bool binary = false;
+  std::string replay;
+  int opt;
+  while ((opt = getopt(argc, argv, "bn:s:")) != -1) {
+    if (opt == 'b') {
+      binary = true;
+    } else if (opt == 'n') {
+      replay = std::string(JOIN_REPLAY_LAST) + optarg;
+    } else if (opt == 's') {
+      replay = std::string(JOIN_REPLAY_SINCE) + optarg;
+    } else {
+      argc = 0; // print the usage message
+    }
+  }
+  argv += optind - 1;
+  argc -= optind - 1;
+
   // Check for correct number of command line arguments
   if (argc != 5) {
-    std::cerr << "Usage: ./receiver [server_address] [port] [username] [room]\n";
+    std::cerr << "Usage: ./receiver [-b] [-n N | -s SEQ] [server_address] [port] [username] [room]\n";
     return 1;
   }
 
@@ -27,7 +47,7 @@ int main(int argc, char **argv) {
   conn.connect(server_hostname, server_port);
 
   // Send rlogin message to identify ourselves to the server
-  Message rlogin_msg(TAG_RLOGIN, username);
+  Message rlogin_msg(OP_RLOGIN, binary ? username + PROTO_V2_REQUEST : username);
   if (!conn.send(rlogin_msg)) {
     std::cerr << "Error: failed to send rlogin message.\n";
     return 1;
@@ -41,13 +61,18 @@ int main(int argc, char **argv) {
   }
 
   // Check if server returned an error
-  if (reply.tag == TAG_ERR) {
+  if (reply.op == OP_ERR) {
     std::cerr << reply.data << "\n";
     return 1;
   }
 
+  // Everything after the login reply is framed if the server agreed
+  if (binary && binary_protocol_accepted(reply)) {
+    conn.set_binary();
+  }
+
   // Send join message to enter the specified room
-  Message join_msg(TAG_JOIN, room_name);
+  Message join_msg(OP_JOIN, room_name + replay);
   if (!conn.send(join_msg)) {
     std::cerr << "Error: failed to send join message.\n";
     return 1;
@@ -60,7 +85,7 @@ int main(int argc, char **argv) {
   }
 
   // Check if server returned an error
-  if (reply.tag == TAG_ERR) {
+  if (reply.op == OP_ERR) {
     std::cerr << reply.data << "\n";
     return 1;
   }
@@ -76,7 +101,7 @@ int main(int argc, char **argv) {
 
 
     // Process delivery messages (actual chat messages)
-    if (reply.tag == TAG_DELIVERY) {
+    if (reply.op == OP_DELIVERY) {
       std::string payload = reply.data;
 
       // Parse the message format: "room:sender:message"
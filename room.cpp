@@ -1,60 +1,319 @@
 #include "guard.h"
+#include "log.h"
+#include "rcu.h"
 #include "message.h"
+#include "delivery.h"
 #include "message_queue.h"
 #include "user.h"
+#include "room_log.h"
+#include "metrics.h"
 #include "room.h"
 
 // Room constructor
 // Initializes a new chat room with the given name
-Room::Room(const std::string &room_name)
+Room::Room(const std::string &room_name, size_t history_size, RoomLog *log)
  // Initialize the room name
-  : room_name(room_name) { 
-    // Initialize the mutex for thread safety
+  : room_name(room_name)
+  , members(new MemberList())
+  , refs(1)
+  , dropped(0)
+  , disconnected(0)
+  , history_mask(0)
+  , next_seq(log ? log->get_next_seq() : 1)
+  , log(log) { 
+    // Initialize the mutexes for thread safety
     pthread_mutex_init(&lock, nullptr);  
+    pthread_mutex_init(&history_lock, nullptr);
+
+    // Round the history up to a power of two so a slot is one mask away
+    if (history_size > 0) {
+        size_t slots = 1;
+        while (slots < history_size) {
+            slots *= 2;
+        }
+        history.assign(slots, nullptr);
+        history_mask = slots - 1;
+    }
+
+    // Refill the history from the room's log (after a restart, or when
+    // an empty room that was reclaimed is created again). Records the
+    // log no longer has leave their slots empty.
+    if (log && !history.empty()) {
+        uint64_t from = next_seq > history.size() ? next_seq - history.size() : 1;
+        std::vector<RoomLog::Record> records;
+        log->read_records(from, records);
+        for (const RoomLog::Record &record : records) {
+            if (record.seq >= next_seq) {
+                break;
+            }
+            history[record.seq & history_mask] = Delivery::create(OP_DELIVERY, record.payload);
+        }
+    }
 }
 
 // Room destructor
 // Cleans up resources when the room is destroyed
 Room::~Room() {
-    pthread_mutex_destroy(&lock);  // Destroy the mutex
+    pthread_mutex_destroy(&lock);  // Destroy the mutexes
+    pthread_mutex_destroy(&history_lock);
+    delete members.load();         // No reader can be using it any more
+    for (Delivery* msg : history) {
+        if (msg) {
+            msg->unref();
+        }
+    }
+}
+
+// Take a reference, unless the last one has already been dropped
+bool Room::try_ref() {
+    unsigned count = refs.load(std::memory_order_relaxed);
+    while (count != 0) {
+        if (refs.compare_exchange_weak(count, count + 1)) {
+            return true;
+        }
+        // count was reloaded by the failed exchange; try again
+    }
+    return false;
+}
+
+// Drop a reference
+bool Room::unref() {
+    return refs.fetch_sub(1) == 1;
+}
+
+// Membership and slow consumer counters
+Room::Stats Room::get_stats() const {
+    Stats stats;
+    {
+        RcuReadGuard rcu_guard;
+        stats.members = members.load(std::memory_order_acquire)->members.size();
+    }
+    stats.dropped = dropped.load(std::memory_order_relaxed);
+    stats.disconnected = disconnected.load(std::memory_order_relaxed);
+    return stats;
+}
+
+// Queue depths of the current receivers; the queues in the snapshot
+// stay valid until the guard goes out of scope
+void Room::get_queue_depths(std::vector<size_t> &depths) const {
+    RcuReadGuard rcu_guard;
+    for (auto &entry : members.load(std::memory_order_acquire)->members) {
+        if (entry.second) {
+            depths.push_back(entry.second->get_depth());
+        }
+    }
+}
+
+// Copy a batch of kept deliveries for replay
+size_t Room::read_history(uint64_t &seq, uint64_t end, std::vector<Delivery*> &batch, size_t max) {
+    size_t count = 0;
+    if (history.empty()) {
+        return count; // the room keeps no history
+    }
+    Guard guard(history_lock);
+    // Anything older than the ring's size has been overwritten
+    uint64_t oldest = next_seq > history.size() ? next_seq - history.size() : 1;
+    if (seq < oldest) {
+        seq = oldest;
+    }
+    for (; seq < end && count < max; seq++) {
+        Delivery* msg = history[seq & history_mask];
+        if (msg) { // (a record lost from the log leaves a gap)
+            msg->ref();
+            batch.push_back(msg);
+            count++;
+        }
+    }
+    return count;
+}
+
+// Replace the member snapshot (lock must be held)
+// Broadcasts that already loaded the old snapshot keep using it, so it
+// is only freed once they have all finished
+void Room::publish(MemberList *new_members) {
+    MemberList* old_members = members.exchange(new_members);
+    rcu_retire_delete(old_members);
 }
 
 // Add a member to the room
 // Associates a user with their message queue for receiving messages
-void Room::add_member(User *user, MessageQueue *mqueue) {
-    Guard guard(lock);  // Lock the mutex 
-    members[user] = mqueue;  // Add the user and their message queue to the members map
+// (nullptr for a member that receives nothing, such as a sender)
+uint64_t Room::add_member(User *user, MessageQueue *mqueue) {
+    Guard guard(lock);  // Lock the mutex (only one writer at a time)
+
+    // Copy the current members, replacing the user's queue if present
+    MemberList* new_members = new MemberList(*members.load());
+    bool found = false;
+    for (auto &entry : new_members->members) {
+        if (entry.first == user) {
+            entry.second = mqueue;
+            found = true;
+        }
+    }
+    if (!found) {
+        new_members->members.push_back(std::make_pair(user, mqueue));
+    }
+
+    // Swap the snapshot in while no broadcast is between numbering its
+    // delivery and loading the snapshot, so every broadcast from
+    // first_live on sees the new member and every earlier one is in
+    // the history
+    MemberList* old_members;
+    uint64_t first_live;
+    {
+        Guard history_guard(history_lock);
+        old_members = members.exchange(new_members);
+        first_live = next_seq;
+    }
+    rcu_retire_delete(old_members);
+    return first_live;
 }
 
 // Remove a member from the room
 // Disassociates a user from the room
 void Room::remove_member(User *user) {
-    Guard guard(lock);  // Lock the mutex
-    members.erase(user);  // Remove the user from the members map
+    Guard guard(lock);  // Lock the mutex (only one writer at a time)
+
+    // Copy the current members, leaving out the user
+    const MemberList* old_members = members.load();
+    MemberList* new_members = new MemberList();
+    new_members->members.reserve(old_members->members.size());
+    for (auto &entry : old_members->members) {
+        if (entry.first != user) {
+            new_members->members.push_back(entry);
+        }
+    }
+    publish(new_members);
+}
+
+// Count what a full queue did with a delivery
+void Room::count_enqueue(const MessageQueue::EnqueueResult &result) {
+    if (result.dropped) {
+        dropped.fetch_add(result.dropped, std::memory_order_relaxed);
+    }
+    if (result.overflowed) {
+        disconnected.fetch_add(1, std::memory_order_relaxed);
+        // (the member's User may already be gone, so no name)
+        LOG_WARN("[server] Disconnecting a slow receiver in room %s\n", room_name.c_str());
+    }
 }
 
 // Broadcast a message to all room members
 // Sends a message from one user to all other users in the room
-void Room::broadcast_message(const std::string &sender_username, const std::string &message_text) {
-    Guard guard(lock);  // Lock the mutex to safely access members
+BlockedBroadcast *Room::broadcast_message(const std::string &sender_username,
+                                          const StringView &message_text, uint64_t ingress_ns,
+                                          QueueListener *space_listener, uint64_t cookie) {
+    // Log the broadcast for monitoring (queued for the log thread)
+    LOG_INFO("[server] Broadcasting from %s: %.*s\n", sender_username.c_str(),
+             (int) message_text.size(), message_text.data());
 
-    // Format the message payload as "roomname:sender:message"
-    std::string payload = room_name + ":" + sender_username + ":" + message_text;
-    
-    // Log the broadcast for debugging/monitoring
-    printf("[server] Broadcasting from %s: %s\n", sender_username.c_str(), message_text.c_str());
+    // Encode the delivery once, with the payload "roomname:sender:message";
+    // this is where the text is first copied out of the sender's input
+    // buffer, straight into the Delivery. Every member's queue shares it.
+    const StringView parts[] = {
+        StringView(room_name), StringView(":", 1), StringView(sender_username),
+        StringView(":", 1), message_text,
+    };
+    Delivery* msg = Delivery::create(OP_DELIVERY, parts, sizeof(parts) / sizeof(parts[0]));
+    msg->set_ingress_ns(ingress_ns);
+    StringView payload = msg->get_data_view();
+
+    // Read the current members without locking; the snapshot (and the
+    // queues in it) stay valid until the guard goes out of scope
+    RcuReadGuard rcu_guard;
+    const MemberList* snapshot;
+    Delivery* evicted = nullptr;
+    if (history.empty() && !log) {
+        snapshot = members.load(std::memory_order_acquire);
+    } else {
+        // Number the delivery and keep it in the ring (which takes a
+        // reference) and the log, in step with add_member
+        Guard history_guard(history_lock);
+        if (!history.empty()) {
+            Delivery *&slot = history[next_seq & history_mask];
+            evicted = slot;
+            msg->ref();
+            slot = msg;
+        }
+        if (log) {
+            log->append(next_seq, payload.data(), payload.size());
+        }
+        next_seq++;
+        snapshot = members.load(std::memory_order_acquire);
+    }
+    if (evicted) {
+        evicted->unref(); // outside the lock, since this may free it
+    }
 
     // Iterate through all members in the room
-    for (auto &entry : members) {
+    BlockedBroadcast* blocked = nullptr;
+    for (auto &entry : snapshot->members) {
         MessageQueue* mqueue = entry.second;  // Get the member's message queue
-        
-        // Create a new message with the formatted payload
-        Message* msg = new Message(TAG_DELIVERY, payload);
-        
-        // Add the message to the member's queue
-        mqueue->enqueue(msg);
-        
+        if (!mqueue) {
+            continue; // a sender, which receives nothing
+        }
+
+        // Add the message to the member's queue (which takes a reference)
+        msg->ref();
+        MessageQueue::EnqueueResult result = mqueue->enqueue(msg, space_listener, cookie);
+
+        // A full BLOCK queue leaves the message with us; the sender
+        // retries it after this RCU section, so it needs a reference
+        // to the queue that outlasts the section
+        if (result.blocked) {
+            msg->unref(); // (ours keeps it alive)
+            if (!blocked) {
+                uint64_t timeout_ns = mqueue->get_limits().block_timeout_ms * 1000000ull;
+                blocked = new BlockedBroadcast{space_listener, cookie, msg, {},
+                                               latency_now() + timeout_ns};
+            }
+            mqueue->ref();
+            blocked->queues.push_back(mqueue);
+            continue;
+        }
+
+        // A full queue may have discarded messages or overflowed
+        count_enqueue(result);
+
         // Log the enqueue operation for debugging
-        printf("[queue] Enqueued message: %s\n", payload.c_str());
+        LOG_DEBUG("[queue] Enqueued message: %.*s\n", (int) payload.size(), payload.data());
+    }
+
+    // Drop our own reference; the queues keep it alive (and so does a
+    // blocked broadcast, which takes ours over)
+    if (!blocked) {
+        msg->unref();
+    }
+    return blocked;
+}
+
+// Try a blocked broadcast's full queues again
+bool Room::retry_blocked(BlockedBroadcast &blocked, uint64_t now, bool give_up) {
+    give_up = give_up || now >= blocked.deadline_ns;
+    size_t still_full = 0;
+    for (MessageQueue* mqueue : blocked.queues) {
+        if (!give_up) {
+            blocked.msg->ref();
+            MessageQueue::EnqueueResult result = mqueue->enqueue(blocked.msg, blocked.listener,
+                                                                 blocked.cookie);
+            if (result.blocked) {
+                blocked.msg->unref();
+                blocked.queues[still_full++] = mqueue;
+                continue;
+            }
+            count_enqueue(result);
+        } else {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        // (it may have been registered again by an earlier attempt)
+        mqueue->cancel_space_listener(blocked.listener, blocked.cookie);
+        mqueue->unref();
+    }
+    blocked.queues.resize(still_full);
+    if (still_full > 0) {
+        return false;
     }
+    blocked.msg->unref();
+    blocked.msg = nullptr;
+    return true;
 }
\ No newline at end of file
@@ -2,28 +2,113 @@
 #define ROOM_H
 
 #include <string>
-#include <map>
+#include <vector>
+#include <atomic>
 #include <pthread.h>
 #include "user.h"
 #include "message_queue.h"
+#include "message.h"
+class Delivery;
+class RoomLog;
+
+// A broadcast that some members' queues (with the BLOCK policy) had no
+// room for. The sender keeps it, with a reference to the delivery and
+// to each of those queues, and handles no more commands until
+// Room::retry_blocked has placed it everywhere or given up on it. The
+// listener is told when one of the queues may have room.
+struct BlockedBroadcast {
+    QueueListener *listener;
+    uint64_t cookie;
+    Delivery *msg;
+    std::vector<MessageQueue*> queues; // still full
+    uint64_t deadline_ns;              // (latency_now) when it is dropped
+};
 
 class Room {
 public:
-    Room(const std::string &room_name);
+    // Membership, and slow consumer counters (see QueueLimits)
+    struct Stats {
+        size_t members;        // members right now (senders included)
+        uint64_t dropped;      // deliveries discarded by full member queues
+        uint64_t disconnected; // members whose queue overflowed
+    };
+
+    // history_size is how many recent deliveries the room keeps for
+    // replay to joining members (0 keeps none). In durable mode every
+    // delivery is also appended to the room's log.
+    Room(const std::string &room_name, size_t history_size = 0, RoomLog *log = nullptr);
     ~Room();
 
-    void add_member(User *user, MessageQueue *mqueue);
+    // Returns the sequence number of the first broadcast that will be
+    // enqueued for the member; earlier ones can only be replayed
+    uint64_t add_member(User *user, MessageQueue *mqueue);
     void remove_member(User *user);
-    void broadcast_message(const std::string &sender_username, const std::string &message_text);
-    std::string get_room_name() const {
+    // ingress_ns is when the message was read from the sender's
+    // socket (0 if unknown), for the latency histograms. Returns
+    // nullptr, or a BlockedBroadcast (for the caller to retry and then
+    // delete) if members' BLOCK queues were full; space_listener and
+    // cookie are passed to their enqueue. The sender is never made to
+    // wait here, inside the RCU read section.
+    BlockedBroadcast *broadcast_message(const std::string &sender_username,
+                                        const StringView &message_text, uint64_t ingress_ns = 0,
+                                        QueueListener *space_listener = nullptr,
+                                        uint64_t cookie = 0);
+
+    // Offer a blocked broadcast to its full queues again, dropping it
+    // for those that are still full if its deadline has passed at now
+    // (a latency_now) or give_up is set. Returns true once none are
+    // left, when the queues and the delivery have been released.
+    bool retry_blocked(BlockedBroadcast &blocked, uint64_t now, bool give_up = false);
+    const std::string &get_room_name() const {
       return room_name;
   }
-  
+
+    // Reference counting, managed by RoomRegistry: every client in the
+    // room holds a reference, and a new room starts with one for the
+    // client that created it. Once the count drops to zero the room is
+    // being reclaimed and can no longer be referenced.
+    bool try_ref();  // false if the count is already zero
+    bool unref();    // true if this dropped the last reference
+
+    Stats get_stats() const;
+
+    // Append the number of deliveries waiting in each receiving
+    // member's queue (for monitoring)
+    void get_queue_depths(std::vector<size_t> &depths) const;
+
+    // Append to batch (with a reference taken for the caller) the kept
+    // deliveries with sequence numbers from seq up to but not including
+    // end, at most max of them, and advance seq past them. Deliveries
+    // that have already been overwritten are skipped. Returns the
+    // number appended; the history lock is only held for one batch.
+    size_t read_history(uint64_t &seq, uint64_t end, std::vector<Delivery*> &batch, size_t max);
 
 private:
+    // An immutable snapshot of the room's members. Joining or leaving
+    // publishes a new snapshot; broadcasts read the current one without
+    // taking the lock (see rcu.h).
+    struct MemberList {
+        std::vector<std::pair<User*, MessageQueue*>> members;
+    };
+
+    void publish(MemberList *new_members);
+    void count_enqueue(const MessageQueue::EnqueueResult &result);
+
     std::string room_name;
-    pthread_mutex_t lock;
-    std::map<User*, MessageQueue*> members;
+    pthread_mutex_t lock; // serializes add_member and remove_member
+    std::atomic<MemberList*> members;
+    std::atomic<unsigned> refs;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> disconnected;
+
+    // Ring of the most recent deliveries: sequence number n is kept in
+    // history[n & history_mask] until it is overwritten by n + size.
+    // Empty if the room keeps no history.
+    pthread_mutex_t history_lock; // orders broadcasts against joins
+    std::vector<Delivery*> history;
+    uint64_t history_mask;
+    uint64_t next_seq;            // protected by history_lock
+    RoomLog *log;                 // appended to under history_lock, or nullptr
 };
 
 #endif
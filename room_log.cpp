@@ -0,0 +1,674 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "guard.h"
+#include "log.h"
+#include "room_log.h"
+
+namespace {
+    const char SEGMENT_MAGIC[8] = { 'C', 'H', 'A', 'T', 'L', 'O', 'G', '1' };
+    const char SEGMENT_SUFFIX[] = ".seg";
+
+    // How long appends to a log whose roll failed (on ENOSPC, say) go
+    // on failing before one tries to roll again
+    const time_t ROLL_RETRY_SECS = 1;
+
+    size_t align_record(size_t len) {
+        const size_t align = RoomLogStore::RECORD_ALIGN;
+        return (len + align - 1) & ~(align - 1);
+    }
+
+    // File name of the segment whose first record is first_seq
+    std::string segment_name(uint64_t first_seq) {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu%s", (unsigned long long) first_seq, SEGMENT_SUFFIX);
+        return name;
+    }
+
+    // Make a directory unless it already exists
+    bool make_dir(const std::string &path) {
+        if (mkdir(path.c_str(), 0755) == 0 || errno == EEXIST) {
+            return true;
+        }
+        LOG_ERROR("[server] Could not create %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Make a new directory entry durable
+    void sync_dir(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd >= 0) {
+            fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    // The index file that goes with a segment
+    std::string index_path(const std::string &segment_path) {
+        return segment_path.substr(0, segment_path.size() - strlen(SEGMENT_SUFFIX)) + ".idx";
+    }
+
+    // A whole file mapped read-only, for as long as the object exists
+    class MappedFile {
+    public:
+        MappedFile() : base(nullptr), size(0) { }
+        ~MappedFile() {
+            if (base) {
+                munmap(const_cast<char *>(base), size);
+            }
+        }
+
+        bool map(const std::string &path) {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    base = static_cast<const char *>(p);
+                    size = st.st_size;
+                }
+            }
+            ::close(fd);
+            return base != nullptr;
+        }
+
+        const char *base;
+        size_t size;
+
+    private:
+        MappedFile(const MappedFile &);
+        MappedFile &operator=(const MappedFile &);
+    };
+
+    // Check for an intact record at pos in a segment
+    bool record_at(const MappedFile &file, size_t pos, RoomLogStore::RecordHeader &header) {
+        if (pos < sizeof(RoomLogStore::SegmentHeader) ||
+            pos + sizeof(header) > file.size) {
+            return false;
+        }
+        memcpy(&header, file.base + pos, sizeof(header));
+        const char *data = file.base + pos + sizeof(header);
+        return header.length != 0 && header.length <= file.size - pos - sizeof(header) &&
+               header.checksum == RoomLogStore::checksum(header.seq, data, header.length);
+    }
+
+    // Call f(header, data) for each record from pos on, stopping at the
+    // end of the segment or at a record torn by a crash
+    template<typename F>
+    void scan_records(const MappedFile &file, size_t pos, F f) {
+        RoomLogStore::RecordHeader header;
+        while (record_at(file, pos, header)) {
+            f(header, file.base + pos + sizeof(header));
+            pos += align_record(sizeof(header) + header.length);
+        }
+    }
+
+    // Where to start reading a segment to find seq: the last index entry
+    // at or before it that leads to an intact record, or the first record
+    size_t find_record(const MappedFile &file, const std::string &path, uint64_t seq) {
+        std::vector<RoomLogStore::IndexEntry> entries;
+        int fd = ::open(index_path(path).c_str(), O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0) {
+            entries.resize(st.st_size / sizeof(RoomLogStore::IndexEntry));
+            ssize_t n = pread(fd, entries.data(), entries.size() * sizeof(entries[0]), 0);
+            entries.resize(n > 0 ? n / sizeof(entries[0]) : 0);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+
+        size_t i = std::upper_bound(entries.begin(), entries.end(), seq,
+                                    [](uint64_t s, const RoomLogStore::IndexEntry &e) {
+                                        return s < e.seq;
+                                    }) - entries.begin();
+        while (i-- > 0) {
+            RoomLogStore::RecordHeader header;
+            if (record_at(file, entries[i].offset, header) && header.seq == entries[i].seq) {
+                return entries[i].offset;
+            }
+            // (an entry written just before a crash may point past the
+            // synced records)
+        }
+        return sizeof(RoomLogStore::SegmentHeader);
+    }
+
+    // Find the sequence number after the last intact record of a segment
+    // (or its first one if it holds none), and in end the offset just
+    // past that record
+    uint64_t find_end(const std::string &path, uint64_t first_seq, size_t &end) {
+        uint64_t next_seq = first_seq;
+        end = sizeof(RoomLogStore::SegmentHeader);
+        MappedFile file;
+        if (file.map(path)) {
+            size_t pos = find_record(file, path, UINT64_MAX);
+            scan_records(file, pos, [&](const RoomLogStore::RecordHeader &header, const char *data) {
+                next_seq = header.seq + 1;
+                end = align_record(data + header.length - file.base);
+            });
+        }
+        return next_seq;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// RoomLog
+////////////////////////////////////////////////////////////////////////
+
+RoomLog::RoomLog(RoomLogStore *store, const std::string &dir)
+  : m_store(store)
+  , m_dir(dir)
+  , m_active(nullptr)
+  , m_kept_bytes(0)
+  , m_next_seq(1)
+  , m_failed(false)
+  , m_roll_failed_at(0) {
+    pthread_mutex_init(&m_lock, nullptr);
+}
+
+// Only called once the commit thread has stopped
+RoomLog::~RoomLog() {
+    commit(time(nullptr));
+    if (m_active) {
+        finish(m_active);
+        delete m_active;
+    }
+    for (Segment *segment : m_kept) {
+        delete segment;
+    }
+    pthread_mutex_destroy(&m_lock);
+}
+
+uint64_t RoomLog::get_next_seq() const {
+    return m_next_seq.load(std::memory_order_relaxed);
+}
+
+// Find the segments left by an earlier run, so they count towards the
+// retention limits and the sequence numbers carry on after them. Only
+// the end of the last segment is read. The earlier segments were
+// trimmed when they were finished, or else were full when they were
+// rolled over, so their file size is what was written to them.
+bool RoomLog::load_segments() {
+    if (!make_dir(m_dir)) {
+        return false;
+    }
+    DIR *dir = opendir(m_dir.c_str());
+    if (!dir) {
+        return false;
+    }
+    std::vector<std::pair<uint64_t, std::string>> found;
+    while (struct dirent *entry = readdir(dir)) {
+        const char *name = entry->d_name;
+        size_t len = strlen(name);
+        size_t suffix_len = strlen(SEGMENT_SUFFIX);
+        if (len > suffix_len && strcmp(name + len - suffix_len, SEGMENT_SUFFIX) == 0) {
+            found.push_back(std::make_pair(strtoull(name, nullptr, 10), m_dir + "/" + name));
+        }
+    }
+    closedir(dir);
+    std::sort(found.begin(), found.end());
+
+    for (auto &entry : found) {
+        struct stat st;
+        if (stat(entry.second.c_str(), &st) < 0) {
+            continue;
+        }
+        size_t size = st.st_size;
+        Segment *segment = new Segment{ entry.second, entry.first, -1, nullptr, size, size, size,
+                                        st.st_mtime, 0, {}, -1 };
+        m_kept.push_back(segment);
+        m_kept_bytes += segment->written;
+        m_segments[entry.first] = entry.second;
+    }
+    if (!m_kept.empty()) {
+        Segment *last = m_kept.back();
+        size_t end;
+        m_next_seq = find_end(last->path, last->first_seq, end);
+        if (m_next_seq == last->first_seq) {
+            // It holds no records, and the next segment will have its name
+            unlink(last->path.c_str());
+            unlink(index_path(last->path).c_str());
+            m_segments.erase(last->first_seq);
+            m_kept_bytes -= last->written;
+            m_kept.pop_back();
+            delete last;
+        } else if (end < last->written) {
+            // A run that stopped without finishing it left it at its
+            // full size, mostly zero fill (and maybe a torn record):
+            // trim it as finish would have, since appends go on in a
+            // new segment
+            if (truncate(last->path.c_str(), end) < 0) {
+                LOG_WARN("[server] Could not trim %s: %s\n", last->path.c_str(), strerror(errno));
+            }
+            m_kept_bytes -= last->written - end;
+            last->size = last->written = last->synced = end;
+        }
+    }
+    return true;
+}
+
+// Start a new segment whose first record is first_seq (m_lock must be
+// held). The old one is left for the commit thread to finish.
+bool RoomLog::roll(uint64_t first_seq) {
+    const RoomLogOptions &options = m_store->m_options;
+    std::string path = m_dir + "/" + segment_name(first_seq);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("[server] Could not create %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    // The file is all zeroes (no blocks, even) until records are copied in
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, options.segment_size) == 0) {
+        map = mmap(nullptr, options.segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        LOG_ERROR("[server] Could not map %s: %s\n", path.c_str(), strerror(errno));
+        ::close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    Segment *segment = new Segment{ path, first_seq, fd, static_cast<char *>(map),
+                                    options.segment_size, sizeof(RoomLogStore::SegmentHeader),
+                                    0, 0, 0, {}, -1 };
+    RoomLogStore::SegmentHeader header;
+    memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+    header.first_seq = first_seq;
+    memcpy(segment->base, &header, sizeof(header));
+
+    if (m_active) {
+        m_active->sealed_at = time(nullptr);
+        m_sealed.push_back(m_active);
+    }
+    m_active = segment;
+    m_segments[first_seq] = path;
+    m_store->m_segments_created.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool RoomLog::append(uint64_t seq, const char *data, size_t len) {
+    size_t record_len = align_record(sizeof(RoomLogStore::RecordHeader) + len);
+    Guard guard(m_lock);
+    if (m_failed || sizeof(RoomLogStore::SegmentHeader) + record_len >
+                    m_store->m_options.segment_size) {
+        // (a record too large for any segment fails on its own)
+        m_store->m_errors.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (!m_active || m_active->written + record_len > m_active->size) {
+        // The segment is full (or this is the first record): roll over.
+        // A failed roll disables the log until a later one succeeds.
+        if (m_roll_failed_at != 0 && time(nullptr) < m_roll_failed_at + ROLL_RETRY_SECS) {
+            m_store->m_errors.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (!roll(seq)) {
+            if (m_roll_failed_at == 0) {
+                m_store->m_disabled.fetch_add(1, std::memory_order_relaxed);
+                LOG_ERROR("[server] Durable log %s disabled\n", m_dir.c_str());
+            }
+            m_roll_failed_at = time(nullptr);
+            m_store->m_errors.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (m_roll_failed_at != 0) {
+            m_roll_failed_at = 0;
+            m_store->m_disabled.fetch_sub(1, std::memory_order_relaxed);
+            LOG_WARN("[server] Durable log %s enabled again\n", m_dir.c_str());
+        }
+    }
+
+    // The checksum lets recovery tell a record torn by a crash from a
+    // whole one, so the order the two are copied in does not matter
+    RoomLogStore::RecordHeader header;
+    header.length = len;
+    header.checksum = RoomLogStore::checksum(seq, data, len);
+    header.seq = seq;
+    char *record = m_active->base + m_active->written;
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), data, len);
+    if (m_active->records++ % RoomLogStore::INDEX_INTERVAL == 0) {
+        m_active->index.push_back(std::make_pair(seq, m_active->written));
+    }
+    m_active->written += record_len;
+    m_next_seq.store(seq + 1, std::memory_order_relaxed);
+
+    m_store->m_records.fetch_add(1, std::memory_order_relaxed);
+    m_store->m_bytes.fetch_add(record_len, std::memory_order_relaxed);
+    return true;
+}
+
+// Read the records from from_seq on. Only the segment that holds
+// from_seq and the ones after it are read, starting from the index
+// entry before it. A segment the commit thread deletes meanwhile is
+// skipped; appends carry on into the last one while it is being read,
+// but a record is only seen once it is complete.
+void RoomLog::read_records(uint64_t from_seq, std::vector<Record> &records) {
+    std::vector<std::pair<uint64_t, std::string>> segments;
+    {
+        Guard guard(m_lock);
+        auto it = m_segments.upper_bound(from_seq);
+        if (it != m_segments.begin()) {
+            --it;
+        }
+        segments.assign(it, m_segments.end());
+    }
+
+    for (auto &segment : segments) {
+        MappedFile file;
+        if (!file.map(segment.second)) {
+            continue;
+        }
+        size_t pos = sizeof(RoomLogStore::SegmentHeader);
+        if (segment.first < from_seq) {
+            pos = find_record(file, segment.second, from_seq);
+        }
+        scan_records(file, pos, [&](const RoomLogStore::RecordHeader &header, const char *data) {
+            if (header.seq >= from_seq) {
+                records.push_back(Record{ header.seq, std::string(data, header.length) });
+            }
+        });
+    }
+}
+
+// Group commit (commit thread): sync what was appended since the last
+// commit, and finish the segments that were rolled over
+void RoomLog::commit(time_t now) {
+    std::vector<Segment *> sealed;
+    Segment *active;
+    size_t end = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> index;
+    {
+        Guard guard(m_lock);
+        sealed.swap(m_sealed);
+        active = m_active;
+        if (active) {
+            end = active->written;
+            index.swap(active->index);
+        }
+    }
+
+    for (Segment *segment : sealed) {
+        sync(segment, segment->written);
+        write_index(segment, segment->index);
+        finish(segment);
+        m_kept.push_back(segment);
+        m_kept_bytes += segment->written;
+    }
+    if (active && end > active->synced) {
+        sync(active, end);
+    }
+    // Index entries only ever point at records that have been synced
+    if (active) {
+        write_index(active, index);
+    }
+    expire(now);
+}
+
+// Write a segment's records up to end to disk (commit thread)
+bool RoomLog::sync(Segment *segment, size_t end) {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    bool first = segment->synced == 0;
+    size_t start = segment->synced & ~(page_size - 1);
+    if (end <= start) {
+        return true;
+    }
+    if (msync(segment->base + start, end - start, MS_SYNC) != 0) {
+        LOG_ERROR("[server] Could not sync %s: %s\n", segment->path.c_str(), strerror(errno));
+        return false;
+    }
+    segment->synced = end;
+    if (first) {
+        sync_dir(m_dir); // the new file's directory entry
+    }
+    m_store->m_commits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// Add index entries to a segment's .idx file (commit thread)
+void RoomLog::write_index(Segment *segment,
+                          const std::vector<std::pair<uint64_t, uint64_t>> &entries) {
+    if (entries.empty()) {
+        return;
+    }
+    if (segment->index_fd < 0) {
+        std::string path = index_path(segment->path);
+        segment->index_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (segment->index_fd < 0) {
+            return; // recovery just reads more of the segment
+        }
+    }
+    std::vector<RoomLogStore::IndexEntry> buf;
+    buf.reserve(entries.size());
+    for (auto &entry : entries) {
+        buf.push_back(RoomLogStore::IndexEntry{ entry.first, entry.second });
+    }
+    ssize_t rc = write(segment->index_fd, buf.data(), buf.size() * sizeof(buf[0]));
+    (void) rc;
+}
+
+// Unmap a segment that was rolled over and trim its unused tail
+// (commit thread)
+void RoomLog::finish(Segment *segment) {
+    munmap(segment->base, segment->size);
+    segment->base = nullptr;
+    if (ftruncate(segment->fd, segment->written) == 0) {
+        segment->size = segment->written;
+    }
+    ::close(segment->fd);
+    segment->fd = -1;
+    if (segment->index_fd >= 0) {
+        ::close(segment->index_fd);
+        segment->index_fd = -1;
+    }
+    std::vector<std::pair<uint64_t, uint64_t>>().swap(segment->index);
+}
+
+// Delete the oldest finished segments while they exceed the retention
+// limits (commit thread)
+void RoomLog::expire(time_t now) {
+    const RoomLogOptions &options = m_store->m_options;
+    while (!m_kept.empty()) {
+        Segment *oldest = m_kept.front();
+        bool too_big = options.retain_bytes > 0 && m_kept_bytes > options.retain_bytes;
+        bool too_old = options.retain_secs > 0 && now - oldest->sealed_at > options.retain_secs;
+        if (!too_big && !too_old) {
+            break;
+        }
+        {
+            Guard guard(m_lock);
+            m_segments.erase(oldest->first_seq);
+        }
+        unlink(oldest->path.c_str());
+        unlink(index_path(oldest->path).c_str());
+        m_kept_bytes -= oldest->written;
+        m_kept.pop_front();
+        delete oldest;
+        m_store->m_segments_deleted.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// RoomLogStore
+////////////////////////////////////////////////////////////////////////
+
+RoomLogStore::RoomLogStore(const RoomLogOptions &options)
+  : m_options(options)
+  , m_started(false)
+  , m_stopping(false)
+  , m_records(0)
+  , m_bytes(0)
+  , m_commits(0)
+  , m_segments_created(0)
+  , m_segments_deleted(0)
+  , m_errors(0)
+  , m_disabled(0) {
+    pthread_mutex_init(&m_lock, nullptr);
+}
+
+RoomLogStore::~RoomLogStore() {
+    if (m_started) {
+        m_stopping = true;
+        pthread_join(m_thread, nullptr);
+    }
+    // Each log commits what is left as it is destroyed
+    for (auto &entry : m_logs) {
+        delete entry.second;
+    }
+    pthread_mutex_destroy(&m_lock);
+}
+
+bool RoomLogStore::start() {
+    if (!make_dir(m_options.dir) || !recover()) {
+        return false;
+    }
+    if (pthread_create(&m_thread, nullptr, committer, this) != 0) {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+// Open the log of every room in the directory. This reads no more than
+// the end of each room's last segment, however long the logs are.
+bool RoomLogStore::recover() {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    DIR *dir = opendir(m_options.dir.c_str());
+    if (!dir) {
+        LOG_ERROR("[server] Could not open %s: %s\n", m_options.dir.c_str(), strerror(errno));
+        return false;
+    }
+    std::vector<std::string> names;
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] != '.' && (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN)) {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    for (const std::string &name : names) {
+        open(unescape_name(name));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    LOG_INFO("[server] Recovered %zu room logs in %.1f ms\n", names.size(),
+             (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return true;
+}
+
+RoomLog *RoomLogStore::open(const std::string &room_name) {
+    Guard guard(m_lock);
+    RoomLog *&log = m_logs[room_name];
+    if (!log) {
+        log = new RoomLog(this, m_options.dir + "/" + escape_name(room_name));
+        if (!log->load_segments()) {
+            log->m_failed = true; // appends will be counted as errors
+            m_disabled.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return log;
+}
+
+RoomLogStore::Stats RoomLogStore::get_stats() const {
+    Stats stats;
+    {
+        Guard guard(m_lock);
+        stats.logs = m_logs.size();
+    }
+    stats.records = m_records.load(std::memory_order_relaxed);
+    stats.bytes = m_bytes.load(std::memory_order_relaxed);
+    stats.commits = m_commits.load(std::memory_order_relaxed);
+    stats.segments_created = m_segments_created.load(std::memory_order_relaxed);
+    stats.segments_deleted = m_segments_deleted.load(std::memory_order_relaxed);
+    stats.errors = m_errors.load(std::memory_order_relaxed);
+    stats.disabled = m_disabled.load(std::memory_order_relaxed);
+    return stats;
+}
+
+// 32-bit FNV-1a over the sequence number and the payload
+uint32_t RoomLogStore::checksum(uint64_t seq, const char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 8; i++) {
+        hash ^= (unsigned char) (seq >> (i * 8));
+        hash *= 16777619u;
+    }
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// A room name as a directory name: letters, digits, '-' and '_' are
+// kept and everything else becomes %XX. Room names are never empty
+// (joins with one are rejected), so this is never the store's own
+// directory.
+std::string RoomLogStore::escape_name(const std::string &room_name) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string escaped;
+    for (unsigned char c : room_name) {
+        if (isalnum(c) || c == '-' || c == '_') {
+            escaped += c;
+        } else {
+            escaped += '%';
+            escaped += hex[c >> 4];
+            escaped += hex[c & 15];
+        }
+    }
+    return escaped;
+}
+
+// Undo escape_name
+std::string RoomLogStore::unescape_name(const std::string &dir_name) {
+    std::string name;
+    for (size_t i = 0; i < dir_name.size(); i++) {
+        if (dir_name[i] == '%' && i + 2 < dir_name.size() && isxdigit((unsigned char) dir_name[i + 1]) &&
+            isxdigit((unsigned char) dir_name[i + 2])) {
+            name += (char) std::stoi(dir_name.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        } else {
+            name += dir_name[i];
+        }
+    }
+    return name;
+}
+
+void *RoomLogStore::committer(void *arg) {
+    static_cast<RoomLogStore *>(arg)->run();
+    return nullptr;
+}
+
+// Commit thread: sync every log once per commit interval
+void RoomLogStore::run() {
+    struct timespec interval;
+    interval.tv_sec = m_options.commit_interval_ms / 1000;
+    interval.tv_nsec = (m_options.commit_interval_ms % 1000) * 1000000L;
+    std::vector<RoomLog *> logs;
+    while (!m_stopping) {
+        nanosleep(&interval, nullptr);
+        {
+            Guard guard(m_lock);
+            logs.clear();
+            for (auto &entry : m_logs) {
+                logs.push_back(entry.second);
+            }
+        }
+        time_t now = time(nullptr);
+        for (RoomLog *log : logs) {
+            log->commit(now);
+        }
+    }
+}
@@ -0,0 +1,207 @@
+#ifndef ROOM_LOG_H
+#define ROOM_LOG_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <pthread.h>
+
+// Durable mode: every delivery broadcast in a room is appended to that
+// room's log, a directory of segment files under RoomLogOptions::dir.
+//
+// A segment is created at its full size and mapped into memory, so an
+// append is a copy into the mapping under the room's log lock and never
+// makes a system call (except when the segment is full and a new one is
+// started). A background thread does the group commit: every commit
+// interval it syncs (msync) whatever each log has appended since the
+// last commit, and finishes segments that have been rolled over. A
+// broadcast does not wait for its record to be committed, so a crash
+// can lose at most the last commit interval.
+//
+// Segments that have been rolled over are deleted, oldest first, once a
+// room's log holds more than retain_bytes or they are older than
+// retain_secs.
+//
+// On disk, DIR/ROOM/FIRSTSEQ.seg (the room name escaped, FIRSTSEQ the
+// sequence number of its first record in 20 decimal digits) holds a
+// SegmentHeader followed by records, each a RecordHeader followed by
+// the delivery's payload and padded to RECORD_ALIGN bytes. A record
+// with length 0 (the file's zero fill) ends the segment.
+//
+// Next to each segment, FIRSTSEQ.idx is a sparse index: an IndexEntry
+// (sequence number and file offset) for every INDEX_INTERVAL-th record,
+// written by the commit thread once the records are synced. It is only
+// a hint, since every record is checked against its checksum, so it is
+// not synced itself. Recovery never reads a log from the start: at
+// startup the store finds each room's log, and the end of the last
+// segment from its last index entry; a room's recent history is read
+// (from the index entry before it) only when the Room is created.
+
+struct RoomLogOptions {
+  std::string dir;         // durable mode is off if this is empty
+  int commit_interval_ms;  // how often appended records are synced
+  size_t segment_size;     // bytes in each segment file
+  uint64_t retain_bytes;   // per room; 0 keeps every segment
+  int retain_secs;         // 0 keeps segments however old they are
+
+  RoomLogOptions()
+    : commit_interval_ms(10)
+    , segment_size(64 << 20)
+    , retain_bytes(0)
+    , retain_secs(0) { }
+
+  bool is_enabled() const { return !dir.empty(); }
+};
+
+class RoomLogStore;
+
+// The log of one room. It outlives the Room (which is reclaimed when
+// empty), so a room that is created again carries on where it left off.
+class RoomLog {
+public:
+  // Append a delivery's payload as record seq. Appends must be made in
+  // sequence order, one at a time (Room holds its history lock).
+  // Returns false if the record could not be written.
+  bool append(uint64_t seq, const char *data, size_t len);
+
+  // The sequence number the next record should have
+  uint64_t get_next_seq() const;
+
+  // Read the kept records from sequence number from_seq on, in order
+  // (used to refill a new Room's history)
+  struct Record {
+    uint64_t seq;
+    std::string payload;
+  };
+  void read_records(uint64_t from_seq, std::vector<Record> &records);
+
+private:
+  friend class RoomLogStore;
+
+  // A segment file, mapped while it is being written. Only the commit
+  // thread syncs, unmaps and deletes segments.
+  struct Segment {
+    std::string path;
+    uint64_t first_seq;
+    int fd;
+    char *base;          // the mapping, or nullptr once finished
+    size_t size;         // bytes mapped
+    size_t written;      // bytes appended (protected by m_lock)
+    size_t synced;       // bytes known to be on disk
+    time_t sealed_at;    // when it was rolled over
+    uint64_t records;    // records appended (protected by m_lock)
+    std::vector<std::pair<uint64_t, uint64_t>> index; // (seq, offset) entries
+                         // not written yet (protected by m_lock)
+    int index_fd;        // the .idx file, once opened (commit thread only)
+  };
+
+  RoomLog(RoomLogStore *store, const std::string &dir);
+  ~RoomLog();
+
+  // prohibit value semantics
+  RoomLog(const RoomLog &);
+  RoomLog &operator=(const RoomLog &);
+
+  bool load_segments();
+  bool roll(uint64_t first_seq);
+  void commit(time_t now);
+  bool sync(Segment *segment, size_t end);
+  void write_index(Segment *segment, const std::vector<std::pair<uint64_t, uint64_t>> &entries);
+  void finish(Segment *segment);
+  void expire(time_t now);
+
+  RoomLogStore *m_store;
+  std::string m_dir;
+  pthread_mutex_t m_lock;      // protects m_active, m_sealed, m_segments
+  Segment *m_active;           // segment being appended to
+  std::map<uint64_t, std::string> m_segments; // every segment's path, by first seq
+  std::vector<Segment *> m_sealed; // rolled over, waiting to be finished
+  std::deque<Segment *> m_kept;    // finished (commit thread only)
+  uint64_t m_kept_bytes;           // written to m_kept's segments (commit thread only)
+  std::atomic<uint64_t> m_next_seq;
+  bool m_failed;               // an earlier run's segments could not be
+                               // found, so it is never appended to
+  time_t m_roll_failed_at;     // when a roll last failed (0: it did not);
+                               // appends fail until one succeeds
+};
+
+class RoomLogStore {
+public:
+  struct Stats {
+    uint64_t logs;             // rooms with a log (recovered or new)
+    uint64_t records;          // records appended
+    uint64_t bytes;            // bytes appended, headers included
+    uint64_t commits;          // segment syncs by the commit thread
+    uint64_t segments_created;
+    uint64_t segments_deleted; // removed by the retention limits
+    uint64_t errors;           // failed appends
+    uint64_t disabled;         // logs that can't be appended to now,
+                               // after an I/O error
+  };
+
+  RoomLogStore(const RoomLogOptions &options);
+  ~RoomLogStore();
+
+  // Create the log directory, or find the room logs already in it, and
+  // start the commit thread
+  bool start();
+
+  // The log of the named room, opened (and its existing segments
+  // found) the first time it is asked for. It is never freed while the
+  // store exists.
+  RoomLog *open(const std::string &room_name);
+
+  Stats get_stats() const;
+
+  // The on-disk layout described above
+  struct SegmentHeader {
+    char magic[8];
+    uint64_t first_seq;
+  };
+  struct RecordHeader {
+    uint32_t length;    // payload bytes (0 ends the segment)
+    uint32_t checksum;  // of the sequence number and the payload
+    uint64_t seq;
+  };
+  struct IndexEntry {
+    uint64_t seq;
+    uint64_t offset;    // of the record in its segment
+  };
+  static const size_t RECORD_ALIGN = 8;
+  static const unsigned INDEX_INTERVAL = 64;
+  static uint32_t checksum(uint64_t seq, const char *data, size_t len);
+  static std::string escape_name(const std::string &room_name);
+  static std::string unescape_name(const std::string &dir_name);
+
+private:
+  friend class RoomLog;
+
+  // prohibit value semantics
+  RoomLogStore(const RoomLogStore &);
+  RoomLogStore &operator=(const RoomLogStore &);
+
+  static void *committer(void *arg);
+  void run();
+  bool recover();
+
+  const RoomLogOptions m_options;
+  mutable pthread_mutex_t m_lock;          // protects m_logs
+  std::map<std::string, RoomLog *> m_logs; // by room name
+  pthread_t m_thread;
+  bool m_started;
+  std::atomic<bool> m_stopping;
+
+  std::atomic<uint64_t> m_records;
+  std::atomic<uint64_t> m_bytes;
+  std::atomic<uint64_t> m_commits;
+  std::atomic<uint64_t> m_segments_created;
+  std::atomic<uint64_t> m_segments_deleted;
+  std::atomic<uint64_t> m_errors;
+  std::atomic<uint64_t> m_disabled;
+};
+
+#endif // ROOM_LOG_H
@@ -0,0 +1,203 @@
+#include "guard.h"
+#include "rcu.h"
+#include "log.h"
+#include "room.h"
+#include "room_log.h"
+#include "room_registry.h"
+
+namespace {
+    // Free a table that was replaced by a larger one, along with its
+    // nodes (the larger table has its own copies of them)
+    template<typename Table, typename Node>
+    void free_table(Table *table) {
+        for (auto &bucket : table->buckets) {
+            Node *node = bucket.load(std::memory_order_relaxed);
+            while (node) {
+                Node *next = node->next.load(std::memory_order_relaxed);
+                delete node;
+                node = next;
+            }
+        }
+        delete table;
+    }
+}
+
+RoomRegistry::RoomRegistry(size_t history_size, RoomLogStore *log_store)
+  : m_history_size(history_size)
+  , m_log_store(log_store)
+  , m_created(0)
+  , m_reclaimed(0) {
+    for (Shard &shard : m_shards) {
+        pthread_mutex_init(&shard.lock, nullptr);
+        shard.table.store(new Table(INITIAL_BUCKETS));
+        shard.count = 0;
+    }
+}
+
+// Only called once no thread can be using the registry
+RoomRegistry::~RoomRegistry() {
+    for (Shard &shard : m_shards) {
+        Table *table = shard.table.load();
+        for (auto &bucket : table->buckets) {
+            for (Node *node = bucket.load(); node; node = node->next.load()) {
+                delete node->room;
+            }
+        }
+        free_table<Table, Node>(table);
+        pthread_mutex_destroy(&shard.lock);
+    }
+}
+
+uint64_t RoomRegistry::hash_name(const std::string &room_name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : room_name) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The top bits pick the shard; the low bits pick the bucket within it
+RoomRegistry::Shard &RoomRegistry::shard_for(uint64_t hash) const {
+    return m_shards[hash >> (64 - SHARD_BITS)];
+}
+
+// Take a reference to the named room in a table, skipping any copy of
+// it that is being reclaimed (caller is in an RCU read-side section or
+// holds the shard lock)
+Room *RoomRegistry::acquire(const Table *table, uint64_t hash,
+                            const std::string &room_name) {
+    Node *node = table->buckets[hash & table->mask].load(std::memory_order_acquire);
+    for (; node; node = node->next.load(std::memory_order_acquire)) {
+        if (node->hash == hash && node->name == room_name && node->room->try_ref()) {
+            return node->room;
+        }
+    }
+    return nullptr;
+}
+
+Room *RoomRegistry::find_or_create(const std::string &room_name) {
+    uint64_t hash = hash_name(room_name);
+    Shard &shard = shard_for(hash);
+
+    // Fast path: the room already exists
+    {
+        RcuReadGuard rcu_guard;
+        Room *room = acquire(shard.table.load(std::memory_order_acquire), hash, room_name);
+        if (room) {
+            return room;
+        }
+    }
+
+    // Slow path: check again under the lock, since another thread may
+    // have created the room in the meantime
+    Guard guard(shard.lock);
+    Table *table = shard.table.load(std::memory_order_relaxed);
+    Room *room = acquire(table, hash, room_name);
+    if (room) {
+        return room;
+    }
+
+    if (shard.count >= table->buckets.size()) {
+        grow(shard);
+        table = shard.table.load(std::memory_order_relaxed);
+    }
+
+    // Link a fully built node at the head of its chain (the new room
+    // starts out with the caller's reference)
+    Node *node = new Node;
+    node->hash = hash;
+    node->name = room_name;
+    node->room = new Room(room_name, m_history_size,
+                          m_log_store ? m_log_store->open(room_name) : nullptr);
+    std::atomic<Node *> &bucket = table->buckets[hash & table->mask];
+    node->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    bucket.store(node, std::memory_order_release);
+    shard.count++;
+    m_created.fetch_add(1, std::memory_order_relaxed);
+    return node->room;
+}
+
+void RoomRegistry::release(Room *room) {
+    if (!room->unref()) {
+        return;
+    }
+
+    // That was the last reference: nobody can take a new one now, so
+    // unlink the room and free it once concurrent lookups are done
+    std::string room_name = room->get_room_name();
+    uint64_t hash = hash_name(room_name);
+    Shard &shard = shard_for(hash);
+    Node *node;
+    {
+        Guard guard(shard.lock);
+        Table *table = shard.table.load(std::memory_order_relaxed);
+        std::atomic<Node *> *link = &table->buckets[hash & table->mask];
+        for (node = link->load(std::memory_order_relaxed); node->room != room;
+             node = link->load(std::memory_order_relaxed)) {
+            link = &node->next;
+        }
+        // Readers already on the node still follow its next pointer
+        link->store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+        shard.count--;
+    }
+
+    struct Retire {
+        static void destroy(void *p) {
+            Node *node = static_cast<Node *>(p);
+            delete node->room;
+            delete node;
+        }
+    };
+    rcu_retire(Retire::destroy, node);
+    m_reclaimed.fetch_add(1, std::memory_order_relaxed);
+    LOG_DEBUG("[server] Reclaimed empty room %s\n", room_name.c_str());
+}
+
+// Double a shard's table (shard lock must be held). Readers may still
+// be walking the old chains, so the new table gets copies of the nodes
+// and the old table is retired rather than freed.
+void RoomRegistry::grow(Shard &shard) {
+    Table *old_table = shard.table.load(std::memory_order_relaxed);
+    Table *new_table = new Table(old_table->buckets.size() * 2);
+    for (auto &bucket : old_table->buckets) {
+        for (Node *node = bucket.load(std::memory_order_relaxed); node;
+             node = node->next.load(std::memory_order_relaxed)) {
+            Node *copy = new Node;
+            copy->hash = node->hash;
+            copy->name = node->name;
+            copy->room = node->room;
+            std::atomic<Node *> &new_bucket = new_table->buckets[node->hash & new_table->mask];
+            copy->next.store(new_bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            new_bucket.store(copy, std::memory_order_relaxed);
+        }
+    }
+    shard.table.store(new_table, std::memory_order_release);
+
+    struct Retire {
+        static void destroy(void *p) { free_table<Table, Node>(static_cast<Table *>(p)); }
+    };
+    rcu_retire(Retire::destroy, old_table);
+}
+
+// Visit every room, one shard at a time
+void RoomRegistry::for_each_room(RoomFunc func, void *arg) const {
+    for (const Shard &shard : m_shards) {
+        RcuReadGuard rcu_guard;
+        const Table *table = shard.table.load(std::memory_order_acquire);
+        for (auto &bucket : table->buckets) {
+            for (Node *node = bucket.load(std::memory_order_acquire); node;
+                 node = node->next.load(std::memory_order_acquire)) {
+                func(node->room, arg);
+            }
+        }
+    }
+}
+
+RoomRegistry::Stats RoomRegistry::get_stats() const {
+    Stats stats;
+    stats.created = m_created.load(std::memory_order_relaxed);
+    stats.reclaimed = m_reclaimed.load(std::memory_order_relaxed);
+    stats.live = stats.created - stats.reclaimed;
+    return stats;
+}
@@ -0,0 +1,106 @@
+#ifndef ROOM_REGISTRY_H
+#define ROOM_REGISTRY_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+class Room;
+class RoomLogStore;
+
+// Concurrent map from room name to Room, replacing the server's
+// std::map under one global mutex.
+//
+// Rooms are spread over NUM_SHARDS independent hash tables by the top
+// bits of the name's hash, which is computed once per call and kept in
+// each entry so chains are scanned by comparing hashes, not strings.
+// Looking up an existing room takes no lock: bucket chains are read in
+// an RCU read-side section (see rcu.h). Only inserting or removing a
+// room (and growing a shard's table) takes that shard's mutex, so joins
+// of different rooms do not contend.
+//
+// Rooms are reference counted (see Room::try_ref). When the last
+// reference is released the room is unlinked and handed to rcu_retire,
+// so a lookup that is still walking the chain never sees freed memory.
+// A room that is being reclaimed is skipped, and a join that arrives
+// meanwhile creates a fresh room of the same name.
+class RoomRegistry {
+public:
+  struct Stats {
+    uint64_t created;   // rooms created since startup
+    uint64_t reclaimed; // rooms freed after their last member left
+    uint64_t live;      // rooms that currently exist
+  };
+
+  // Rooms are created keeping history_size deliveries for replay, and
+  // with their logs from log_store in durable mode
+  explicit RoomRegistry(size_t history_size = 0, RoomLogStore *log_store = nullptr);
+  ~RoomRegistry();
+
+  // Return the room with the given name, creating it if necessary,
+  // with a reference held for the caller
+  Room *find_or_create(const std::string &room_name);
+
+  // Drop a reference obtained from find_or_create; the room is
+  // reclaimed when the last one is dropped
+  void release(Room *room);
+
+  Stats get_stats() const;
+
+  // Call func(room, arg) for every room in the registry, for
+  // monitoring. It runs in an RCU read-side section (one per shard),
+  // so it should be quick, and it may see a room that is being
+  // reclaimed (with no members left); it must not take a reference.
+  typedef void (*RoomFunc)(const Room *room, void *arg);
+  void for_each_room(RoomFunc func, void *arg) const;
+
+  // 64-bit FNV-1a hash of a room name
+  static uint64_t hash_name(const std::string &room_name);
+
+private:
+  // prohibit value semantics
+  RoomRegistry(const RoomRegistry &);
+  RoomRegistry &operator=(const RoomRegistry &);
+
+  // An entry is immutable once linked into a chain (except for its
+  // next pointer, which only changes under the shard lock)
+  struct Node {
+    uint64_t hash;
+    std::string name;
+    Room *room;
+    std::atomic<Node *> next;
+  };
+
+  // A shard's bucket array; replaced (not resized in place) when it grows
+  struct Table {
+    size_t mask; // number of buckets - 1
+    std::vector<std::atomic<Node *>> buckets;
+
+    explicit Table(size_t num_buckets)
+      : mask(num_buckets - 1), buckets(num_buckets) { }
+  };
+
+  struct Shard {
+    pthread_mutex_t lock;       // serializes inserts into this shard
+    std::atomic<Table *> table;
+    size_t count;               // protected by lock
+    char pad[64];               // keep shards on separate cache lines
+  };
+
+  static const unsigned SHARD_BITS = 6;
+  static const unsigned NUM_SHARDS = 1u << SHARD_BITS;
+  static const size_t INITIAL_BUCKETS = 16;
+
+  Shard &shard_for(uint64_t hash) const;
+  static Room *acquire(const Table *table, uint64_t hash, const std::string &room_name);
+  void grow(Shard &shard);
+
+  const size_t m_history_size;
+  RoomLogStore *const m_log_store;
+  mutable Shard m_shards[NUM_SHARDS];
+  std::atomic<uint64_t> m_created;
+  std::atomic<uint64_t> m_reclaimed;
+};
+
+#endif // ROOM_REGISTRY_H
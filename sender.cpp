@@ -1,16 +1,57 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <cstdlib>
 #include <stdexcept>
 #include "csapp.h"
 #include "message.h"
 #include "connection.h"
 #include "client_util.h"
 
+// Largest -w window. The server stops reading commands while its
+// replies are not being read, so the replies to a full window must fit
+// in the socket buffers for both sides to keep making progress.
+static const int MAX_WINDOW = 1024;
+
+namespace {
+  // Wait for the reply to the oldest command in flight, reporting an
+  // error reply. Returns false if no reply could be received.
+  bool await_reply(Connection &conn, Message &reply) {
+    if (!conn.receive(reply)) {
+      std::cerr << "Error: failed to receive reply from server.\n";
+      return false;
+    }
+
+    // Check if server returned an error
+    if (reply.op == OP_ERR) {
+      std::cerr << reply.data << std::endl;
+    }
+    return true;
+  }
+}
+
 int main(int argc, char **argv) {
+  // -b asks the server for the binary protocol; -w N keeps up to N
+  // commands in flight instead of waiting for each reply (the server
+  // answers them in order), which speeds up bulk input from stdin
+  bool binary = false;
+  int window = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "bw:")) != -1) {
+    if (opt == 'b') {
+      binary = true;
+    } else if (opt == 'w' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_WINDOW) {
+      window = atoi(optarg);
+    } else {
+      argc = 0; // print the usage message
+    }
+  }
+  argv += optind - 1;
+  argc -= optind - 1;
+
   // Check for correct number of command line arguments
   if (argc != 4) {
-    std::cerr << "Usage: ./sender [server_address] [port] [username]\n";
+    std::cerr << "Usage: ./sender [-b] [-w window] [server_address] [port] [username]\n";
     return 1;
   }
 
@@ -26,7 +67,7 @@ int main(int argc, char **argv) {
   conn.connect(server_hostname, server_port);
 
   // Step 1: Send slogin message to identify as sender
-  Message login_msg(TAG_SLOGIN, username);
+  Message login_msg(OP_SLOGIN, binary ? username + PROTO_V2_REQUEST : username);
   if (!conn.send(login_msg)) {
     std::cerr << "Error: failed to send slogin message.\n";
     return 1;
@@ -40,11 +81,23 @@ int main(int argc, char **argv) {
   }
 
   // Check if server returned an error
-  if (reply.tag == TAG_ERR) {
+  if (reply.op == OP_ERR) {
     std::cerr << reply.data << std::endl;
     return 1;
   }
 
+  // Everything after the login reply is framed if the server agreed
+  if (binary && binary_protocol_accepted(reply)) {
+    conn.set_binary();
+  }
+
+  // With a window, commands are buffered and written together whenever
+  // the sender stops to wait for replies
+  if (window > 1) {
+    conn.set_buffered();
+  }
+  int in_flight = 0; // commands sent whose reply has not been read
+
   // Step 2: Main command/message input loop
   std::string line;
   while (std::getline(std::cin, line)) {
@@ -66,7 +119,7 @@ int main(int argc, char **argv) {
         // Join a room: /join [room_name]
         std::string room;
         if (iss >> room) {
-          out_msg.tag = TAG_JOIN;
+          out_msg.op = OP_JOIN;
           out_msg.data = room;
         } else {
           std::cerr << "Usage: /join [room_name]" << std::endl;
@@ -74,20 +127,27 @@ int main(int argc, char **argv) {
         }
       } else if (cmd == "/leave") {
         // Leave current room
-        out_msg.tag = TAG_LEAVE;
+        out_msg.op = OP_LEAVE;
         out_msg.data = "";  // No data needed for leave
       } else if (cmd == "/quit") {
         // Quit the program
-        out_msg.tag = TAG_QUIT;
+        out_msg.op = OP_QUIT;
         out_msg.data = "bye";  // Payload should be non-empty
+
+        // Collect the replies to the commands still in flight
+        for (; in_flight > 0; in_flight--) {
+          if (!await_reply(conn, reply)) {
+            return 1;
+          }
+        }
         
         // Send quit message and handle response
         conn.send(out_msg);
-        if (conn.receive(reply) && reply.tag == TAG_OK) {
+        if (conn.receive(reply) && reply.op == OP_OK) {
           return 0;  // Exit normally if server acknowledges
         } else {
           // Handle error cases
-          std::cerr << (reply.tag == TAG_ERR ? reply.data : "Unknown error") << std::endl;
+          std::cerr << (reply.op == OP_ERR ? reply.data : "Unknown error") << std::endl;
           return 1;
         }
       } else {
@@ -97,7 +157,7 @@ int main(int argc, char **argv) {
       }
     } else {
       // Regular message to send to current room
-      out_msg.tag = TAG_SENDALL;
+      out_msg.op = OP_SENDALL;
       out_msg.data = line;
     }
 
@@ -107,15 +167,18 @@ int main(int argc, char **argv) {
       return 1;
     }
 
-    // Wait for server response
-    if (!conn.receive(reply)) {
-      std::cerr << "Error: failed to receive reply from server.\n";
-      return 1;
+    // Wait for server responses once the window is full
+    for (in_flight++; in_flight >= window; in_flight--) {
+      if (!await_reply(conn, reply)) {
+        return 1;
+      }
     }
+  }
 
-    // Check if server returned an error
-    if (reply.tag == TAG_ERR) {
-      std::cerr << reply.data << std::endl;
+  // End of input: collect the remaining replies
+  for (; in_flight > 0; in_flight--) {
+    if (!await_reply(conn, reply)) {
+      return 1;
     }
   }
 
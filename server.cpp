@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <poll.h>
 #include <iostream>
 #include <sstream>
 #include <memory>
@@ -8,165 +9,284 @@
 #include <cassert>
 #include "message.h"
 #include "connection.h"
+#include "delivery.h"
 #include "user.h"
 #include "room.h"
 #include "guard.h"
+#include "log.h"
+#include "session.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "metrics.h"
+#include "admin.h"
 #include "server.h"
 
-////////////////////////////////////////////////////////////////////////
-// Server implementation data types
-////////////////////////////////////////////////////////////////////////
-
-// Structure to hold information about each connected client
-struct ClientInfo {
-    Connection* conn;    // Network connection to the client
-    Server* server;      // Reference to the main server
-    MessageQueue* mqueue; // Message queue for receiving messages
-    Room* room;          // Current room the client is in
-    User* user;          // User information
-};
-
 ////////////////////////////////////////////////////////////////////////
 // Client thread functions
 ////////////////////////////////////////////////////////////////////////
 
 namespace {
+    // Lets a sender's thread sleep while a broadcast of its is blocked
+    // on full BLOCK queues, until a consumer makes room
+    class SpaceWaiter : public QueueListener {
+    public:
+        SpaceWaiter() : m_notified(false) {
+            pthread_mutex_init(&m_lock, nullptr);
+            // waits are timed on the monotonic clock, like latency_now
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&m_cond, &attr);
+            pthread_condattr_destroy(&attr);
+        }
+
+        ~SpaceWaiter() {
+            pthread_cond_destroy(&m_cond);
+            pthread_mutex_destroy(&m_lock);
+        }
+
+        virtual void on_message_available(uint64_t) {}
+
+        virtual void on_space_available(uint64_t) {
+            Guard guard(m_lock);
+            m_notified = true;
+            pthread_cond_signal(&m_cond);
+        }
+
+        // Wait to be told about room, or until deadline_ns (latency_now)
+        void wait(uint64_t deadline_ns) {
+            struct timespec deadline;
+            deadline.tv_sec = deadline_ns / 1000000000u;
+            deadline.tv_nsec = deadline_ns % 1000000000u;
+            Guard guard(m_lock);
+            while (!m_notified) {
+                if (pthread_cond_timedwait(&m_cond, &m_lock, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+            m_notified = false;
+        }
+
+    private:
+        pthread_mutex_t m_lock;
+        pthread_cond_t m_cond;
+        bool m_notified; // protected by m_lock
+    };
+
     // Function to handle communication with a sender client
     void chat_with_sender(ClientInfo* client) {
         Connection* conn = client->conn;
-        Server* server = client->server;
-    
+        SpaceWaiter waiter;
+        client->space_listener = &waiter;
+
         while (true) {
-            Message msg;
-            // Receive a message from the client
+            MessageView msg;
+            // Receive a message from the client (without copying it)
             if (!conn->receive(msg)) {
                 break; // client disconnected
             }
-    
-            // Handle different message types from sender
-            if (msg.tag == TAG_SENDALL) {
-                // Broadcast message to all in the room
-                if (client->room) {
-                    client->room->broadcast_message(client->user->username, msg.data);
-                    conn->send(Message(TAG_OK, "message sent"));
-                } else {
-                    conn->send(Message(TAG_ERR, "not in a room"));
-                }
-            } else if (msg.tag == TAG_JOIN) {
-                // Join a room (or create if new)
-                Room* new_room = server->find_or_create_room(msg.data);
-                if (client->room) {
-                    client->room->remove_member(client->user);
-                }
-                client->room = new_room;
-                client->room->add_member(client->user, client->mqueue);
-                conn->send(Message(TAG_OK, "joined room " + client->room->get_room_name()));
-            } else if (msg.tag == TAG_LEAVE) {
-                // Leave current room
-                if (client->room) {
-                    client->room->remove_member(client->user);
-                    conn->send(Message(TAG_OK, "left room " + client->room->get_room_name()));
-                    client->room = nullptr;
-                } else {
-                    conn->send(Message(TAG_ERR, "not in a room"));
-                }
-            } else if (msg.tag == TAG_QUIT) {
-                // Quit the connection
-                conn->send(Message(TAG_OK, "bye!"));
+
+            // Handle the command and send back the reply
+            Message reply;
+            bool keep_going = session_sender_message(client, msg, reply);
+            conn->send(reply);
+            if (!keep_going) {
                 break; // Exit the sender loop
-            } else {
-                conn->send(Message(TAG_ERR, "invalid command"));
+            }
+
+            // A broadcast that full BLOCK queues did not take holds off
+            // the next command (the wait is outside the broadcast's RCU
+            // read section, on this sender's own thread)
+            while (client->blocked) {
+                waiter.wait(client->blocked->deadline_ns);
+                session_retry_blocked(client);
             }
         }
+        client->space_listener = nullptr;
     }
-    
+
+    // Most deliveries a replay copies out of a room's history at once
+    // (the room's history lock is held while they are copied)
+    const size_t REPLAY_BATCH = 64;
+
     // Function to handle communication with a receiver client
     void chat_with_receiver(ClientInfo* client) {
         Connection* conn = client->conn;
 
         // Step 1: Receiver must first send JOIN to specify which room to receive from
-        Message join_msg;
+        MessageView join_msg;
         if (!conn->receive(join_msg)) {
-            conn->send(Message(TAG_ERR, "invalid message"));
+            conn->send(Message(OP_ERR, "invalid message"));
             return;
         }
 
-        if (join_msg.tag != TAG_JOIN) {
-            conn->send(Message(TAG_ERR, "Expected JOIN"));
+        // Step 2: Add receiver to the room
+        Message reply;
+        bool joined = session_receiver_join(client, join_msg, reply);
+        conn->send(reply);
+        if (!joined) {
             return;
         }
 
-        // Step 2: Add receiver to the room
-        Room* new_room = client->server->find_or_create_room(join_msg.data);
-        if (client->room) {
-            client->room->remove_member(client->user);
+        // Step 3: Send the deliveries it asked to have replayed. Live
+        // ones collect in its queue meanwhile and follow on from them.
+        std::vector<Delivery*> batch; // reused for every wakeup
+        while (session_replay_batch(client, batch, REPLAY_BATCH) > 0) {
+            bool sent = conn->send_batch(batch);
+            for (Delivery* msg : batch) {
+                msg->unref();
+            }
+            batch.clear();
+            if (!sent) {
+                return;
+            }
+        }
+        if (!conn->flush()) {
+            return;
+        }
+
+        // Step 4: Receiver sleeps until either messages arrive in its queue
+        // or something happens on the socket, then sends what is queued.
+        // An idle receiver stays blocked in poll and uses no CPU at all.
+        struct pollfd fds[2];
+        fds[0].fd = client->mqueue->get_wakeup_fd();
+        fds[0].events = POLLIN;
+        fds[1].fd = conn->get_fd();
+        fds[1].events = POLLIN | POLLRDHUP;
+        if (fds[0].fd < 0) {
+            return;
         }
-        client->room = new_room;
-        client->room->add_member(client->user, client->mqueue);
-        conn->send(Message(TAG_OK, "welcome"));
 
-        // Step 3: Receiver continuously dequeues and sends messages from the room
         while (true) {
-            Message* msg = client->mqueue->dequeue();
-            if (msg) {
-                if (!conn->send(*msg)) {
-                    delete msg;
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+
+            // Receivers send nothing after joining, so socket activity
+            // means the client went away (anything else is ignored)
+            if (fds[1].revents != 0 && !conn->discard_input()) {
+                break; // disconnected
+            }
+
+            // A receiver this far behind is dropped (see QueueLimits)
+            if (client->mqueue->is_overflowed()) {
+                break;
+            }
+
+            if (fds[0].revents & POLLIN) {
+                // Reset the eventfd, then send everything queued
+                uint64_t count;
+                ssize_t rc = read(fds[0].fd, &count, sizeof(count));
+                (void) rc;
+
+                bool sent = true;
+                while (sent && client->mqueue->dequeue_batch(batch) > 0) {
+                    uint64_t taken_ns = latency_stamp();
+                    sent = conn->send_batch(batch);
+                    if (sent && taken_ns != 0) {
+                        session_record_sent(batch, taken_ns);
+                    }
+                    for (Delivery* msg : batch) {
+                        msg->unref(); // done with our reference
+                    }
+                    batch.clear();
+                }
+                // The queue is empty, so push out the rest now
+                if (!sent || !conn->flush()) {
                     break; // disconnected
                 }
-                delete msg;
             }
         }
     }
 
-    // Worker thread function that handles each client connection
-    void *worker(void *arg) {
-        pthread_detach(pthread_self()); // Detach thread so it cleans up automatically
+    // Number of pool workers when the options don't say
+    const int DEFAULT_POOL_SIZE = 64;
 
-        ClientInfo* client = static_cast<ClientInfo*>(arg);
+    // Run a whole client session on the calling thread
+    void serve_client(ClientInfo* client) {
         Connection* conn = client->conn;
 
+        // Replies are buffered and go out together when the client has
+        // no more commands waiting (see Connection::set_buffered)
+        conn->set_buffered();
+
         // Step 1: Receive login message
-        Message login_msg;
-        if (!conn->receive(login_msg)) {
-            goto cleanup; // connection error
-        }
+        MessageView login_msg;
+        if (conn->receive(login_msg)) {
+            Message reply;
+            bool logged_in = session_login(client, login_msg, reply);
+            conn->send(reply);
+            if (logged_in && client->binary) {
+                conn->set_binary(); // the rest of the session uses frames
+            }
 
-        // Validate login message
-        if (login_msg.tag != TAG_SLOGIN && login_msg.tag != TAG_RLOGIN) {
-            conn->send(Message(TAG_ERR, "expected slogin or rlogin"));
-            goto cleanup;
+            // Handle sender or receiver based on login type
+            if (logged_in && login_msg.op == OP_SLOGIN) {
+                chat_with_sender(client); // Enter sender loop
+            } else if (logged_in && login_msg.op == OP_RLOGIN) {
+                chat_with_receiver(client); // Enter receiver loop
+            }
         }
 
-        if (login_msg.data.empty()) {
-            conn->send(Message(TAG_ERR, "empty username"));
-            goto cleanup;
-        }
+        // Clean up resources when client disconnects
+        session_cleanup(client);
+    }
+
+    // Worker thread function that handles each client connection
+    void *worker(void *arg) {
+        pthread_detach(pthread_self()); // Detach thread so it cleans up automatically
+        serve_client(static_cast<ClientInfo*>(arg));
+        return nullptr;
+    }
 
-        // Set up client information
-        client->user = new User(login_msg.data);
-        client->mqueue = new MessageQueue();
-        client->room = nullptr;
+    // Like open_listenfd, but sets SO_REUSEPORT so that several sockets
+    // can listen on the same port and the kernel spreads connections
+    // between them
+    int open_reuseport_listenfd(const char *port) {
+        struct addrinfo hints, *listp, *p;
+        int listenfd = -1, optval = 1;
 
-        // Handle sender or receiver based on login type
-        if (login_msg.tag == TAG_SLOGIN) {
-            conn->send(Message(TAG_OK, "logged in as " + login_msg.data));
-            chat_with_sender(client); // Enter sender loop
-        } else if (login_msg.tag == TAG_RLOGIN) {
-            conn->send(Message(TAG_OK, "logged in as " + login_msg.data));
-            chat_with_receiver(client); // Enter receiver loop
+        // Get a list of potential server addresses
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+        if (getaddrinfo(NULL, port, &hints, &listp) != 0) {
+            return -1;
         }
 
-    cleanup:
-        // Clean up resources when client disconnects
-        if (client->room) {
-            client->room->remove_member(client->user);
+        // Walk the list for one that we can bind to
+        for (p = listp; p; p = p->ai_next) {
+            listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+            if (listenfd < 0) {
+                continue;
+            }
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+            if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == 0
+                && bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+                break; // Success
+            }
+            close(listenfd);
+            listenfd = -1;
         }
-        delete client->user;
-        delete client->mqueue;
-        delete client->conn;
-        delete client;
-        return nullptr;
+        freeaddrinfo(listp);
+
+        // Make it a listening socket ready to accept connection requests
+        if (listenfd >= 0 && ::listen(listenfd, LISTENQ) < 0) {
+            close(listenfd);
+            return -1;
+        }
+        return listenfd;
     }
+
+    // Information an acceptor thread needs
+    struct AcceptorInfo {
+        Server* server;
+        int ssock;
+        int cpu;
+    };
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -174,46 +294,205 @@ namespace {
 ////////////////////////////////////////////////////////////////////////
 
 // Server constructor
-Server::Server(int port)
+Server::Server(int port, const ServerOptions &options)
   : m_port(port)      // Set server port
-  , m_ssock(-1) {     // Initialize socket to invalid
-    pthread_mutex_init(&m_lock, nullptr); // Initialize mutex for thread safety
+  , m_log_store(options.room_log.is_enabled() ? new RoomLogStore(options.room_log) : nullptr)
+  , m_rooms(options.history_size, m_log_store)
+  , m_options(options)
+  , m_next_loop(0)
+  , m_pool(nullptr)
+  , m_admin(nullptr) {
 }
 
 // Server destructor
 Server::~Server() {
-    pthread_mutex_destroy(&m_lock); // Clean up mutex
+    delete m_admin;
+    for (EventLoop* loop : m_loops) {
+        delete loop;
+    }
+    delete m_pool;
+    delete m_log_store; // commits what the rooms appended last
 }
 
 // Start listening on the server port
 bool Server::listen() {
-    m_ssock = open_listenfd(std::to_string(m_port).c_str());
-    return (m_ssock >= 0); // Return true if listening socket was created successfully
+    // Durable mode: rooms append to their logs from the start
+    if (m_log_store && !m_log_store->start()) {
+        return false;
+    }
+
+    std::string port = std::to_string(m_port);
+    if (m_options.num_acceptors <= 1) {
+        int ssock = open_listenfd(port.c_str());
+        if (ssock < 0) {
+            return false;
+        }
+        m_ssocks.push_back(ssock);
+    } else {
+        // One SO_REUSEPORT socket per acceptor thread
+        for (int i = 0; i < m_options.num_acceptors; i++) {
+            int ssock = open_reuseport_listenfd(port.c_str());
+            if (ssock < 0) {
+                return false;
+            }
+            m_ssocks.push_back(ssock);
+        }
+    }
+
+    // Start the event loop threads that will service clients
+    if (m_options.mode == ServerOptions::EVENT_LOOP) {
+        int num_loops = m_options.num_threads;
+        if (num_loops <= 0) {
+            num_loops = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (num_loops <= 0) {
+            num_loops = 1;
+        }
+        for (int i = 0; i < num_loops; i++) {
+            EventLoop* loop = new EventLoop(this);
+            if (!loop->start()) {
+                delete loop;
+                return false;
+            }
+            m_loops.push_back(loop);
+        }
+    }
+
+    // Or spawn the worker threads
+    if (m_options.mode == ServerOptions::THREAD_POOL) {
+        int num_workers = m_options.num_threads > 0 ? m_options.num_threads : DEFAULT_POOL_SIZE;
+        int capacity = m_options.queue_capacity > 0 ? m_options.queue_capacity : 1;
+        m_pool = new WorkerPool(num_workers, capacity, serve_client);
+        if (!m_pool->start()) {
+            return false;
+        }
+    }
+
+    // The admin endpoint answers from a thread of its own
+    if (!m_options.admin_address.empty()) {
+        m_admin = new AdminListener(this, m_options.admin_address);
+        if (!m_admin->start()) {
+            LOG_ERROR("[server] Could not open the admin endpoint %s\n",
+                      m_options.admin_address.c_str());
+            return false;
+        }
+    }
+    return true; // Listening socket was created successfully
 }
 
 // Main server loop to handle incoming client connections
 void Server::handle_client_requests() {
+    if (m_ssocks.size() == 1) {
+        accept_clients(m_ssocks[0]);
+        return;
+    }
+
+    // Every listening socket gets its own accept thread, pinned to a
+    // core; the calling thread becomes the first of them. All of them
+    // share this Server, so rooms are the same whichever one accepted.
+    int num_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus <= 0) {
+        num_cpus = 1;
+    }
+    for (size_t i = 1; i < m_ssocks.size(); i++) {
+        AcceptorInfo* info = new AcceptorInfo{this, m_ssocks[i], (int) i % num_cpus};
+        pthread_t thr_id;
+        pthread_create(&thr_id, nullptr, acceptor, info);
+    }
+    acceptor(new AcceptorInfo{this, m_ssocks[0], 0});
+}
+
+// Acceptor thread function: pin to a core, then accept forever
+void *Server::acceptor(void *arg) {
+    AcceptorInfo* info = static_cast<AcceptorInfo*>(arg);
+    Server* server = info->server;
+    int ssock = info->ssock;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(info->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    delete info;
+
+    server->accept_clients(ssock);
+    return nullptr;
+}
+
+// Accept clients on one listening socket
+void Server::accept_clients(int ssock) {
     while (true) {
         // Accept new client connection
-        int csock = Accept(m_ssock, nullptr, nullptr);
+        int csock = Accept(ssock, nullptr, nullptr);
         if (csock < 0) {
             continue; // Skip if accept failed
         }
-        // Create new connection and client info
-        Connection* conn = new Connection(csock);
-        ClientInfo* info = new ClientInfo{conn, this, nullptr, nullptr, nullptr};
-        // Create worker thread to handle this client
-        pthread_t thr_id;
-        pthread_create(&thr_id, nullptr, worker, info);
+        dispatch_client(csock);
     }
 }
 
+// Hand an accepted client to a worker thread or an event loop
+void Server::dispatch_client(int csock) {
+    metrics_add(METRIC_CONNECTIONS_OPENED);
+    if (m_options.mode == ServerOptions::EVENT_LOOP) {
+        // Spread clients over the event loops round-robin
+        EventLoop* loop = m_loops[m_next_loop++ % m_loops.size()];
+        loop->add_client(csock);
+        return;
+    }
+
+    // Create new connection and client info
+    Connection* conn = new Connection(csock);
+    ClientInfo* info = new ClientInfo{conn, this, nullptr, nullptr, nullptr, false};
+
+    if (m_options.mode == ServerOptions::THREAD_POOL) {
+        if (!m_options.reject_when_full) {
+            // Blocks while the pool is saturated, which stops us
+            // accepting so new clients stay in the listen backlog
+            m_pool->submit(info);
+        } else if (!m_pool->try_submit(info)) {
+            // Saturated: tell the client rather than keep it waiting
+            conn->send(Message(OP_ERR, "server busy"));
+            session_cleanup(info);
+        }
+        return;
+    }
+
+    // Create worker thread to handle this client
+    pthread_t thr_id;
+    pthread_create(&thr_id, nullptr, worker, info);
+}
+
 // Find or create a room with the given name
 Room *Server::find_or_create_room(const std::string &room_name) {
-    Guard guard(m_lock); // Thread-safe access to rooms map
-    Room* &room = m_rooms[room_name]; // Get reference to room pointer
-    if (!room) {
-        room = new Room(room_name); // Create new room if it doesn't exist
+    // Existing rooms are found without locking (see room_registry.h)
+    return m_rooms.find_or_create(room_name);
+}
+
+// Leave a room; the last client out frees it
+void Server::release_room(Room *room) {
+    m_rooms.release(room);
+}
+
+RoomRegistry::Stats Server::get_room_stats() const {
+    return m_rooms.get_stats();
+}
+
+void Server::for_each_room(RoomRegistry::RoomFunc func, void *arg) const {
+    m_rooms.for_each_room(func, arg);
+}
+
+bool Server::get_worker_pool_stats(WorkerPool::Stats &stats) const {
+    if (!m_pool) {
+        return false;
+    }
+    stats = m_pool->get_stats();
+    return true;
+}
+
+bool Server::get_room_log_stats(RoomLogStore::Stats &stats) const {
+    if (!m_log_store) {
+        return false;
     }
-    return room;
+    stats = m_log_store->get_stats();
+    return true;
 }
\ No newline at end of file
@@ -1,35 +1,106 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <map>
 #include <string>
+#include <vector>
+#include <atomic>
 #include <pthread.h>
+#include "room_registry.h"
+#include "message_queue.h"
+#include "room_log.h"
+#include "worker_pool.h"
 class Room;
+class EventLoop;
+class AdminListener;
+
+// Settings controlling how the server services its clients
+struct ServerOptions {
+  // ways in which accepted connections can be serviced
+  enum Mode {
+    THREAD_PER_CONNECTION, // one detached thread per client (original design)
+    EVENT_LOOP,            // clients multiplexed over a fixed set of epoll threads
+    THREAD_POOL,           // fixed pool of worker threads fed by a bounded queue
+  };
+
+  Mode mode;
+  int num_threads;       // event loop threads or pool workers (0 means a default)
+  int queue_capacity;    // THREAD_POOL: clients that may wait for a worker
+  bool reject_when_full; // THREAD_POOL: turn clients away with an error when the
+                         // queue is full, rather than leave them in the backlog
+  int num_acceptors;     // listening sockets, each with its own pinned accept
+                         // thread (more than one uses SO_REUSEPORT)
+  QueueLimits queue_limits; // bounds on each receiver's message queue
+                            // (unbounded by default)
+  size_t history_size;   // deliveries each room keeps for replay on join
+  RoomLogOptions room_log; // durable mode (off unless a directory is given)
+  std::string admin_address; // admin endpoint: a port on the loopback
+                             // interface, or a Unix socket path (off if empty)
+
+  ServerOptions()
+    : mode(EVENT_LOOP)
+    , num_threads(0)
+    , queue_capacity(128)
+    , reject_when_full(false)
+    , num_acceptors(1)
+    , history_size(0) { }
+};
 
 class Server {
 public:
-  Server(int port);
+  Server(int port, const ServerOptions &options = ServerOptions());
   ~Server();
 
   bool listen();
 
   void handle_client_requests();
 
+  // Returns the room with a reference held for the caller, which must
+  // hand it back with release_room when it leaves the room
   Room *find_or_create_room(const std::string &room_name);
+  void release_room(Room *room);
+
+  // Limits for each client's message queue
+  const QueueLimits &get_queue_limits() const { return m_options.queue_limits; }
+
+  // Deliveries each room keeps for replay (0 if none)
+  size_t get_history_size() const { return m_options.history_size; }
+
+  // Rooms created, reclaimed and currently live
+  RoomRegistry::Stats get_room_stats() const;
+
+  // Call func for every room (see RoomRegistry::for_each_room)
+  void for_each_room(RoomRegistry::RoomFunc func, void *arg) const;
+
+  // The worker pool's counters; false unless in THREAD_POOL mode
+  bool get_worker_pool_stats(WorkerPool::Stats &stats) const;
+
+  // The room logs' counters; false unless in durable mode
+  bool get_room_log_stats(RoomLogStore::Stats &stats) const;
 
 private:
   // prohibit value semantics
   Server(const Server &);
   Server &operator=(const Server &);
 
-  typedef std::map<std::string, Room *> RoomMap;
+  // accept clients on one listening socket forever
+  void accept_clients(int ssock);
+  static void *acceptor(void *arg);
+
+  // hand a newly accepted client socket to whatever services clients
+  void dispatch_client(int csock);
 
   // These member variables are sufficient for implementing
   // the server operations
   int m_port;
-  int m_ssock;
-  RoomMap m_rooms;
-  pthread_mutex_t m_lock;
+  std::vector<int> m_ssocks; // listening sockets, one per acceptor
+  RoomLogStore *m_log_store; // only used in durable mode
+  RoomRegistry m_rooms;
+
+  ServerOptions m_options;
+  std::vector<EventLoop *> m_loops; // only used in EVENT_LOOP mode
+  std::atomic<unsigned> m_next_loop; // round-robin assignment of clients
+  WorkerPool *m_pool;               // only used in THREAD_POOL mode
+  AdminListener *m_admin;           // only if an admin address is given
 };
 
 #endif // SERVER_H
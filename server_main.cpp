@@ -1,25 +1,166 @@
 #include <iostream>
+#include <algorithm>
 #include <csignal>
+#include <cstring>
+#include <unistd.h>
 #include "server.h"
+#include "log.h"
 
 // If you implement the Server class as described by its
 // TODO comments, you should not need to make any changes
 // to this main function.
 
+namespace {
+  // A segment must hold at least one record of any size
+  const unsigned long MIN_SEGMENT_SIZE = 64 * 1024;
+
+  void usage() {
+    std::cerr << "Usage: server_main [options] <port>\n"
+              << "Options:\n"
+              << "  -m epoll|threads|pool  client handling mode (default epoll)\n"
+              << "  -t N                   event loop threads (default: one per CPU)\n"
+              << "                         or pool workers (default 64)\n"
+              << "  -q N                   pool mode: max clients waiting for a worker (default 128)\n"
+              << "  -r                     pool mode: reject clients when the queue is full\n"
+              << "                         instead of leaving them in the listen backlog\n"
+              << "  -a N                   accept on N SO_REUSEPORT sockets, each with its\n"
+              << "                         own accept thread pinned to a core (default 1)\n"
+              << "  -l LEVEL               log level: debug|info|warn|error|off (default info)\n"
+              << "  -Q N[:BYTES]           limit each receiver's queue to N messages (0: no limit)\n"
+              << "                         and optionally BYTES bytes (default: unbounded)\n"
+              << "  -P POLICY[:MS]         what to do when a receiver's queue is full:\n"
+              << "                         oldest|newest (drop that message), disconnect, or\n"
+              << "                         block (hold off the sender up to MS ms, default 100)\n"
+              << "  -H N                   keep each room's last N deliveries for receivers\n"
+              << "                         that join with a replay option (default 0)\n"
+              << "  -D DIR                 durable mode: append every room's messages to\n"
+              << "                         segment files under DIR\n"
+              << "  -C MS                  durable mode: sync appended messages every MS ms (default 10)\n"
+              << "  -S BYTES               durable mode: size of each segment file (default 64M)\n"
+              << "  -R BYTES[:SECS]        durable mode: delete a room's oldest segments beyond\n"
+              << "                         BYTES bytes, or older than SECS seconds (0: keep)\n"
+              << "  -M PORT|PATH           admin endpoint: answer connections to PORT on the\n"
+              << "                         loopback interface (or to the Unix socket PATH)\n"
+              << "                         with a snapshot of the server's counters\n";
+  }
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    std::cerr << "Usage: server_main <port>\n";
+  ServerOptions options;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:q:ra:l:Q:P:H:D:C:S:R:M:")) != -1) {
+    switch (opt) {
+    case 'm':
+      if (strcmp(optarg, "epoll") == 0) {
+        options.mode = ServerOptions::EVENT_LOOP;
+      } else if (strcmp(optarg, "threads") == 0) {
+        options.mode = ServerOptions::THREAD_PER_CONNECTION;
+      } else if (strcmp(optarg, "pool") == 0) {
+        options.mode = ServerOptions::THREAD_POOL;
+      } else {
+        usage();
+        return 1;
+      }
+      break;
+    case 't':
+      options.num_threads = std::stoi(optarg);
+      break;
+    case 'q':
+      options.queue_capacity = std::stoi(optarg);
+      break;
+    case 'r':
+      options.reject_when_full = true;
+      break;
+    case 'a':
+      options.num_acceptors = std::stoi(optarg);
+      break;
+    case 'l': {
+      int level = log_level_from_name(optarg);
+      if (level < 0) {
+        usage();
+        return 1;
+      }
+      log_set_level(level);
+      break;
+    }
+    case 'Q': {
+      std::string limit = optarg;
+      size_t colon = limit.find(':');
+      options.queue_limits.max_messages = std::stoul(limit.substr(0, colon));
+      if (colon != std::string::npos) {
+        options.queue_limits.max_bytes = std::stoul(limit.substr(colon + 1));
+      }
+      break;
+    }
+    case 'P': {
+      QueueLimits &limits = options.queue_limits;
+      std::string policy = optarg;
+      size_t colon = policy.find(':');
+      if (colon != std::string::npos) {
+        limits.block_timeout_ms = std::stoi(policy.substr(colon + 1));
+        policy.erase(colon);
+      }
+      if (policy == "oldest") {
+        limits.policy = QueueLimits::DROP_OLDEST;
+      } else if (policy == "newest") {
+        limits.policy = QueueLimits::DROP_NEWEST;
+      } else if (policy == "disconnect") {
+        limits.policy = QueueLimits::DISCONNECT;
+      } else if (policy == "block") {
+        limits.policy = QueueLimits::BLOCK;
+      } else {
+        usage();
+        return 1;
+      }
+      break;
+    }
+    case 'H':
+      options.history_size = std::stoul(optarg);
+      break;
+    case 'D':
+      options.room_log.dir = optarg;
+      break;
+    case 'C':
+      options.room_log.commit_interval_ms = std::max(1, std::stoi(optarg));
+      break;
+    case 'S':
+      options.room_log.segment_size = std::max(MIN_SEGMENT_SIZE, std::stoul(optarg));
+      break;
+    case 'R': {
+      std::string limit = optarg;
+      size_t colon = limit.find(':');
+      options.room_log.retain_bytes = std::stoull(limit.substr(0, colon));
+      if (colon != std::string::npos) {
+        options.room_log.retain_secs = std::stoi(limit.substr(colon + 1));
+      }
+      break;
+    }
+    case 'M':
+      options.admin_address = optarg;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage();
     return 1;
   }
 
-  int port = std::stoi(argv[1]);
+  int port = std::stoi(argv[optind]);
 
   // ignore SIGPIPE: when the server sends data to the receive client,
   // it may find that the connection has been terminated (e.g., if the
   // receive client exited)
   signal(SIGPIPE, SIG_IGN);
 
-  Server server(port);
+  // log messages are written to stdout by a background thread
+  log_start();
+
+  Server server(port, options);
   if (!server.listen()) {
     std::cerr << "Could not listen on port " << port << "\n";
     return 1;
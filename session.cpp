@@ -0,0 +1,285 @@
+#include <string>
+#include <stdexcept>
+#include "message.h"
+#include "message_queue.h"
+#include "delivery.h"
+#include "connection.h"
+#include "user.h"
+#include "room.h"
+#include "server.h"
+#include "rcu.h"
+#include "metrics.h"
+#include "session.h"
+
+// Handle the login message that starts every session
+bool session_login(ClientInfo* client, const MessageView &msg, Message &reply) {
+    // Validate login message
+    if (msg.op != OP_SLOGIN && msg.op != OP_RLOGIN) {
+        reply = Message(OP_ERR, "expected slogin or rlogin");
+        return false;
+    }
+
+    // A client that wants the binary protocol says so after its username
+    std::string username = msg.data.str();
+    const std::string request(PROTO_V2_REQUEST);
+    client->binary = false;
+    if (username.size() >= request.size() &&
+        username.compare(username.size() - request.size(), request.size(), request) == 0) {
+        username.erase(username.size() - request.size());
+        client->binary = true;
+    }
+
+    if (username.empty()) {
+        reply = Message(OP_ERR, "empty username");
+        return false;
+    }
+
+    // Set up client information
+    client->user = new User(username);
+    client->mqueue = new MessageQueue(client->server->get_queue_limits());
+    client->room = nullptr;
+    client->replay_next = client->replay_end = 0;
+
+    reply = Message(OP_OK, "logged in as " + username);
+    if (client->binary) {
+        reply.data += PROTO_V2_ACCEPTED;
+    }
+    return true;
+}
+
+namespace {
+    // A handler for one kind of message from a logged-in sender
+    typedef bool (*SenderHandler)(ClientInfo* client, const MessageView &msg, Message &reply);
+
+    // Whether a delivery of text from username to room_name, encoded as
+    // a "delivery:room:sender:text\n" line, fits in Message::MAX_LEN.
+    // Binary senders may send longer data than that, but every member
+    // gets the same delivery, and a text receiver would see the line
+    // split in two (and the second half as an invalid message).
+    bool fits_text_delivery(const std::string &room_name, const std::string &username,
+                            const StringView &text) {
+        size_t len = opcode_tag(OP_DELIVERY).len + 1 + room_name.size() + 1 +
+                     username.size() + 1 + text.size() + 1;
+        return len <= Message::MAX_LEN;
+    }
+
+    // Broadcast message to all in the room
+    bool sender_sendall(ClientInfo* client, const MessageView &msg, Message &reply) {
+        if (!client->room) {
+            reply = Message(OP_ERR, "not in a room");
+        } else if (!fits_text_delivery(client->room->get_room_name(), client->user->username,
+                                       msg.data)) {
+            reply = Message(OP_ERR, "message too long");
+        } else {
+            // (a full BLOCK queue holds the sender off afterwards, not here)
+            client->blocked = client->room->broadcast_message(client->user->username, msg.data,
+                                                              msg.received_ns,
+                                                              client->space_listener,
+                                                              client->space_cookie);
+            reply = Message(OP_OK, "message sent");
+        }
+        return true;
+    }
+
+    // Join a room (or create if new)
+    bool sender_join(ClientInfo* client, const MessageView &msg, Message &reply) {
+        if (msg.data.empty()) {
+            reply = Message(OP_ERR, "empty room name");
+            return true;
+        }
+        Room* new_room = client->server->find_or_create_room(msg.data.str());
+        if (client->room) {
+            client->room->remove_member(client->user);
+            client->server->release_room(client->room);
+        }
+        client->room = new_room;
+        // Senders never read deliveries, so they join without a queue
+        // (otherwise it would only fill up, or count as a slow consumer)
+        client->room->add_member(client->user, nullptr);
+        reply = Message(OP_OK, "joined room " + client->room->get_room_name());
+        return true;
+    }
+
+    // Leave current room
+    bool sender_leave(ClientInfo* client, const MessageView &, Message &reply) {
+        if (client->room) {
+            client->room->remove_member(client->user);
+            reply = Message(OP_OK, "left room " + client->room->get_room_name());
+            client->server->release_room(client->room);
+            client->room = nullptr;
+        } else {
+            reply = Message(OP_ERR, "not in a room");
+        }
+        return true;
+    }
+
+    // Quit the connection
+    bool sender_quit(ClientInfo*, const MessageView &, Message &reply) {
+        reply = Message(OP_OK, "bye!");
+        return false; // Exit the sender loop
+    }
+
+    // Parse the number in a replay option: decimal digits only (no sign,
+    // spaces or trailing characters), and within range
+    bool parse_replay_number(const std::string &text, uint64_t &value) {
+        if (text.empty() || text[0] < '0' || text[0] > '9') {
+            return false;
+        }
+        try {
+            size_t pos;
+            value = std::stoull(text, &pos);
+            return pos == text.size();
+        } catch (const std::exception &) {
+            return false; // out of range
+        }
+    }
+
+    // Anything a sender may not send (or an unknown tag)
+    bool sender_invalid(ClientInfo*, const MessageView &, Message &reply) {
+        reply = Message(OP_ERR, "invalid command");
+        return true;
+    }
+
+    // Indexed by opcode, so a command is dispatched with one lookup
+    constexpr SenderHandler SENDER_HANDLERS[NUM_OPCODES] = {
+        sender_invalid,  // OP_NONE
+        sender_invalid,  // OP_ERR
+        sender_invalid,  // OP_OK
+        sender_invalid,  // OP_SLOGIN
+        sender_invalid,  // OP_RLOGIN
+        sender_join,     // OP_JOIN
+        sender_leave,    // OP_LEAVE
+        sender_sendall,  // OP_SENDALL
+        sender_invalid,  // OP_SENDUSER
+        sender_quit,     // OP_QUIT
+        sender_invalid,  // OP_DELIVERY
+        sender_invalid,  // OP_EMPTY
+    };
+}
+
+// Handle one message from a sender client
+bool session_sender_message(ClientInfo* client, const MessageView &msg, Message &reply) {
+    // Connection::receive only ever produces valid opcodes (or OP_NONE)
+    return SENDER_HANDLERS[msg.op](client, msg, reply);
+}
+
+// Handle the join message that a receiver must send first
+bool session_receiver_join(ClientInfo* client, const MessageView &msg, Message &reply) {
+    if (msg.op != OP_JOIN) {
+        reply = Message(OP_ERR, "Expected JOIN");
+        return false;
+    }
+
+    // The room name may be followed by a replay option
+    std::string room_name = msg.data.str();
+    uint64_t replay_last = 0, replay_since = 0;
+    bool has_since = false;
+    size_t space = room_name.rfind(' ');
+    if (space != std::string::npos) {
+        std::string option = room_name.substr(space);
+        const std::string last(JOIN_REPLAY_LAST), since(JOIN_REPLAY_SINCE);
+        bool valid = true;
+        if (option.compare(0, last.size(), last) == 0) {
+            valid = parse_replay_number(option.substr(last.size()), replay_last);
+            room_name.erase(space);
+        } else if (option.compare(0, since.size(), since) == 0) {
+            valid = has_since = parse_replay_number(option.substr(since.size()), replay_since);
+            room_name.erase(space);
+        }
+        if (!valid) {
+            reply = Message(OP_ERR, "invalid replay option");
+            return false;
+        }
+    }
+    if (room_name.empty()) {
+        reply = Message(OP_ERR, "empty room name");
+        return false;
+    }
+
+    // Add receiver to the room
+    Room* new_room = client->server->find_or_create_room(room_name);
+    if (client->room) {
+        client->room->remove_member(client->user);
+        client->server->release_room(client->room);
+    }
+    client->room = new_room;
+    uint64_t first_live = client->room->add_member(client->user, client->mqueue);
+
+    // Everything before first_live that was asked for comes from the
+    // room's history (see session_replay_batch)
+    client->replay_end = first_live;
+    if (replay_last > 0) {
+        client->replay_next = first_live > replay_last ? first_live - replay_last : 0;
+    } else if (has_since) {
+        client->replay_next = replay_since; // (0 or 1: everything kept)
+    } else {
+        client->replay_next = first_live;
+    }
+
+    reply = Message(OP_OK, "welcome");
+    if (client->server->get_history_size() > 0) {
+        reply.data += JOIN_SEQ + std::to_string(first_live);
+    }
+    return true;
+}
+
+// Place a blocked broadcast in the queues that were full
+bool session_retry_blocked(ClientInfo* client, bool give_up) {
+    if (!client->blocked) {
+        return true;
+    }
+    if (!client->room->retry_blocked(*client->blocked, latency_now(), give_up)) {
+        return false;
+    }
+    delete client->blocked;
+    client->blocked = nullptr;
+    return true;
+}
+
+// Stream a receiver's replay out of the room's history
+size_t session_replay_batch(ClientInfo* client, std::vector<Delivery*> &batch, size_t max) {
+    if (!client->room || client->replay_next >= client->replay_end) {
+        return 0;
+    }
+    size_t count = client->room->read_history(client->replay_next, client->replay_end, batch, max);
+    if (count == 0) {
+        client->replay_next = client->replay_end; // nothing left is kept
+    }
+    return count;
+}
+
+// Time the deliveries a receiver just sent
+void session_record_sent(const std::vector<Delivery*> &batch, uint64_t taken_ns) {
+    uint64_t now = latency_now();
+    for (Delivery* msg : batch) {
+        latency_record(LATENCY_WRITE, now - taken_ns);
+        if (msg->get_ingress_ns() != 0) {
+            latency_record(LATENCY_END_TO_END, now - msg->get_ingress_ns());
+        }
+    }
+}
+
+namespace {
+    void unref_queue(void *mqueue) {
+        static_cast<MessageQueue*>(mqueue)->unref();
+    }
+}
+
+// Clean up resources when client disconnects
+void session_cleanup(ClientInfo* client) {
+    metrics_add(METRIC_CONNECTIONS_CLOSED);
+    session_retry_blocked(client, true);
+    if (client->room) {
+        client->room->remove_member(client->user);
+        client->server->release_room(client->room);
+    }
+    delete client->user;
+    // A broadcast that started before remove_member may still be
+    // enqueuing into the queue, so drop our reference to it after the
+    // grace period (a blocked sender may hold another one)
+    if (client->mqueue) {
+        rcu_retire(unref_queue, client->mqueue);
+    }
+    delete client->conn;
+    delete client;
+}
@@ -0,0 +1,71 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <vector>
+#include <cstdint>
+#include "message.h"
+class Connection;
+class Delivery;
+class Server;
+class MessageQueue;
+class QueueListener;
+class Room;
+struct User;
+struct BlockedBroadcast;
+
+// Structure to hold information about each connected client
+struct ClientInfo {
+    Connection* conn;    // Network connection to the client
+    Server* server;      // Reference to the main server
+    MessageQueue* mqueue; // Message queue for receiving messages
+    Room* room;          // Current room the client is in
+    User* user;          // User information
+    bool binary;         // client asked for the binary protocol at login;
+                         // its Connection switches once the reply is sent
+    uint64_t replay_next; // receiver: next kept delivery to replay, up to
+    uint64_t replay_end;  // (not including) the first live one
+    QueueListener* space_listener; // sender: told when a full BLOCK queue
+    uint64_t space_cookie;         // may have room again (see enqueue)
+    BlockedBroadcast* blocked;     // sender: a broadcast still waiting for
+                                   // room, and until then no more commands
+};
+
+// The protocol steps of a client session. Each function handles one
+// message received from the client and fills in the reply that should
+// be sent back. They never touch the socket themselves, so the same
+// logic drives both the blocking worker threads and the event loop.
+// A false return value means the session ends once the reply is sent.
+// The message is a view into the connection's input buffer, so nothing
+// is copied unless a handler needs to keep it.
+
+// Handle the first message of a session (slogin or rlogin)
+bool session_login(ClientInfo* client, const MessageView &msg, Message &reply);
+
+// Handle one command from a logged-in sender
+bool session_sender_message(ClientInfo* client, const MessageView &msg, Message &reply);
+
+// Handle the join message a receiver sends after logging in
+bool session_receiver_join(ClientInfo* client, const MessageView &msg, Message &reply);
+
+// Retry the broadcast a sender is blocked on (client->blocked), giving
+// up on the full queues once its deadline passes or give_up is set.
+// Returns true when the sender may go on with its next command.
+bool session_retry_blocked(ClientInfo* client, bool give_up = false);
+
+// Fetch the next batch of deliveries a receiver asked to have replayed
+// when it joined (at most max, each with a reference for the caller).
+// Returns 0 once the replay is over; until then the receiver's queue
+// must not be drained, since it holds the deliveries that follow.
+size_t session_replay_batch(ClientInfo* client, std::vector<Delivery*> &batch, size_t max);
+
+// Count the write and end-to-end latency (see metrics.h) of a batch of
+// live deliveries that were taken from the receiver's queue at taken_ns
+// and have just been handed to its socket (taken_ns is a latency_stamp,
+// and not 0)
+void session_record_sent(const std::vector<Delivery*> &batch, uint64_t taken_ns);
+
+// Release everything owned by a session (room membership, user,
+// message queue, connection) and the ClientInfo itself
+void session_cleanup(ClientInfo* client);
+
+#endif // SESSION_H
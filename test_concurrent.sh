@@ -1,6 +1,12 @@
 #!/bin/bash
 
 # Usage: ./test_concurrent.sh [port] [iterations] [settle]
+#
+# VALGRIND_ENABLE=1 runs the server under valgrind. LOADGEN_ENABLE=1
+# also runs ./loadgen against the server for the settle period, in
+# rooms of its own, as background load well beyond what the workers
+# below create; the test then also fails if loadgen reports a lost,
+# reordered or rejected message.
 
 #############################################
 # globals section
@@ -16,6 +22,7 @@ REF_SENDER="reference/ref-sender"
 REF_RECEIVER="reference/ref-receiver"
 SERVER_PID=0
 RECEIVER_PID=0
+LOADGEN_PID=0
 declare -a CLIENT_PIDS
 declare -a PIPE_RES_PIDS
 #############################################
@@ -32,6 +39,10 @@ cleanup() {
         kill ${FLAGS} ${PID} > /dev/null 2>&1
         wait ${PID} 2> /dev/null
     done
+    if [[ ${LOADGEN_PID} -ne 0 ]]; then
+        kill ${FLAGS} ${LOADGEN_PID} > /dev/null 2>&1
+        wait ${LOADGEN_PID} 2> /dev/null
+    fi
     if [[ ${RECEIVER_PID} -ne 0 ]]; then
         kill ${FLAGS} ${RECEIVER_PID} > /dev/null 2>&1
         wait ${RECEIVER_PID} 2> /dev/null
@@ -267,6 +278,16 @@ RECEIVER_PID=$!
 # wait for receiver to come up
 sleep 0.5
 
+# background load from hundreds of clients in one process (started
+# first, since it connects them one at a time)
+if [[ ${LOADGEN_ENABLE} -eq 1 ]]; then
+    echo "spawning loadgen"
+    ./loadgen -s 20 -r 200 -n 4 -t 20 -d ${TIMEOUT} localhost ${PORT} \
+        > "concur-loadgen.out" 2>&1 &
+    LOADGEN_PID=$!
+    sleep 1
+fi
+
 # spawn send workers
 echo "spawning workers"
 makepipe ${TEMP_DIR}/concur_1.in
@@ -311,11 +332,23 @@ if [[ $? -ne 0 ]]; then
     exit 1
 fi
 
+# loadgen stops by itself once it has drained the last deliveries
+LOADGEN_RETCODE=0
+if [[ ${LOADGEN_PID} -ne 0 ]]; then
+    wait ${LOADGEN_PID} || LOADGEN_RETCODE=$?
+    LOADGEN_PID=0
+fi
+
 # clean up everything
 echo "cleaning up run"
 cleanup
 trap - ERR
 
+if [[ ${LOADGEN_RETCODE} -ne 0 ]]; then
+    echo "loadgen failed (see concur-loadgen.out)"
+    exit 1
+fi
+
 echo "verifying outputs"
 # verify outputs
 verify concur.out
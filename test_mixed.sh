@@ -0,0 +1,111 @@
+#!/bin/bash
+
+# Usage: ./test_mixed.sh [port]
+#
+# Text and binary clients share one room. A binary sender broadcasts a
+# message that fits in a text line, one that only fits in a frame, and
+# then another that fits. The server must reject the long one, and both
+# receivers must get the other two and stay connected.
+
+#############################################
+# globals section
+#############################################
+PORT=$1
+
+ROOM="partytime"
+SHORT_MSG="a message that fits in a text line"
+LONG_MSG=$(printf 'x%.0s' $(seq 1000))
+SERVER_PID=0
+declare -a RECEIVER_PIDS
+#############################################
+# functions section
+#############################################
+cleanup() {
+    local PID=0
+    for PID in "${RECEIVER_PIDS[@]}"; do
+        kill -9 ${PID} > /dev/null 2>&1
+        wait ${PID} 2> /dev/null
+    done
+    if [[ ${SERVER_PID} -ne 0 ]]; then
+        kill -9 ${SERVER_PID} > /dev/null 2>&1
+        wait ${SERVER_PID} 2> /dev/null
+    fi
+}
+
+# cleanup all resources on error
+error_cleanup () {
+    echo $1
+    cleanup
+    exit 1
+}
+
+# check that a receiver got exactly the two short messages
+verify() {
+    local FILE=$1
+    local EXPECTED="bob: ${SHORT_MSG} 1
+bob: ${SHORT_MSG} 2"
+
+    if [[ "$(cat ${FILE})" != "${EXPECTED}" ]]; then
+        echo "unexpected deliveries in ${FILE}:"
+        cat ${FILE}
+        return 1
+    fi
+    return 0
+}
+
+#############################################
+# Script body
+#############################################
+if [[ "$#" -ne 1 ]]; then
+    echo "Usage: ./$0 [port]"
+    exit 1
+fi
+trap "error_cleanup 'cleanup on SIGINT...'" SIGINT
+trap "error_cleanup 'cleanup on SIGTERM...'" SIGTERM
+
+echo "spawning server"
+./server -l warn ${PORT} &
+SERVER_PID=$!
+sleep 0.5
+
+echo "spawning receivers"
+stdbuf -oL ./receiver localhost ${PORT} eva ${ROOM} \
+    1> "mixed-text.out" 2> "mixed-text.err" &
+RECEIVER_PIDS+=($!)
+stdbuf -oL ./receiver -b localhost ${PORT} dave ${ROOM} \
+    1> "mixed-binary.out" 2> "mixed-binary.err" &
+RECEIVER_PIDS+=($!)
+sleep 0.5
+
+echo "sending from a binary sender"
+(
+    echo "/join ${ROOM}"
+    echo "${SHORT_MSG} 1"
+    echo "${LONG_MSG}"
+    echo "${SHORT_MSG} 2"
+    echo "/quit"
+) | timeout 5 ./sender -b localhost ${PORT} bob > /dev/null 2> "mixed-sender.err"
+sleep 0.5
+
+echo "verifying outputs"
+RESULT=0
+for PID in "${RECEIVER_PIDS[@]}"; do
+    if ! kill -0 ${PID} 2> /dev/null; then
+        echo "a receiver was disconnected"
+        RESULT=1
+    fi
+done
+if [[ "$(cat mixed-sender.err)" != "message too long" ]]; then
+    echo "the long message was not rejected"
+    RESULT=1
+fi
+verify mixed-text.out || RESULT=1
+verify mixed-binary.out || RESULT=1
+cleanup
+
+if [[ ${RESULT} -eq 0 ]]; then
+    echo "Tests passed successfully!"
+fi
+
+# exit with correct code
+exit ${RESULT}
@@ -0,0 +1,147 @@
+#!/bin/bash
+
+# Usage: ./test_restart.sh [port] [restarts] [messages]
+#
+# Restarts a durable server (-D) again and again, killing it with
+# SIGKILL each time so that it never finishes its last segment, with a
+# retention limit (-R) well above what is actually written. Nothing may
+# be deleted, and a receiver that joins with a replay option must get
+# every message from every run, in order.
+
+#############################################
+# globals section
+#############################################
+PORT=$1
+RESTARTS=$2
+COUNTS=$3
+
+ROOM="partytime"
+TEMP_DIR="/tmp/${RANDOM}"
+LOG_DIR="${TEMP_DIR}/logs"
+RETAIN_BYTES=1000000
+SERVER_PID=0
+#############################################
+# functions section
+#############################################
+cleanup() {
+    if [[ ${SERVER_PID} -ne 0 ]]; then
+        kill -9 ${SERVER_PID} > /dev/null 2>&1
+        wait ${SERVER_PID} 2> /dev/null
+    fi
+    SERVER_PID=0
+}
+
+# cleanup all resources on error
+error_cleanup () {
+    echo $1
+    cleanup
+    rm -rf ${TEMP_DIR}
+    exit 1
+}
+
+start_server() {
+    ./server -l warn -D ${LOG_DIR} -H $((RESTARTS * COUNTS)) -R ${RETAIN_BYTES} ${PORT} &
+    SERVER_PID=$!
+    # wait for server to come up
+    sleep 0.5
+}
+
+# send one run's messages, then kill the server without letting it
+# finish its segment
+run_once() {
+    local RUN=$1
+    local IDX=0
+
+    start_server
+    (
+        echo "/join ${ROOM}"
+        while [[ ${IDX} -lt ${COUNTS} ]]; do
+            echo "run${RUN} message ${IDX}"
+            IDX=$((IDX+1))
+        done
+        echo "/quit"
+    ) | timeout 5 ./sender localhost ${PORT} bob > /dev/null
+    # wait for the log to be synced
+    sleep 0.2
+    cleanup
+}
+
+# check that the replay holds every run's messages in order
+verify() {
+    local FILE=$1
+    local RUN=1
+    local IDX=0
+
+    while read LINE; do
+        EXPECTED="bob: run${RUN} message ${IDX}"
+        if [[ ${RUN} -gt ${RESTARTS} ]]; then
+            echo "too many lines in file ${FILE}"
+            return 1
+        fi
+        if [[ "${LINE}" != "${EXPECTED}" ]]; then
+            echo "expected ${EXPECTED} but got ${LINE}"
+            return 1
+        fi
+        IDX=$((IDX+1))
+        if [[ ${IDX} -eq ${COUNTS} ]]; then
+            RUN=$((RUN+1))
+            IDX=0
+        fi
+    done < "${FILE}"
+    if [[ ${RUN} -le ${RESTARTS} ]]; then
+        echo "too few lines for file ${FILE}"
+        return 1
+    fi
+    return 0
+}
+
+#############################################
+# Script body
+#############################################
+if [[ "$#" -ne 3 ]]; then
+    echo "Usage: ./$0 [port] [restarts] [messages]"
+    exit 1
+fi
+trap "error_cleanup 'cleanup on SIGINT...'" SIGINT
+trap "error_cleanup 'cleanup on SIGTERM...'" SIGTERM
+
+rm -rf ${TEMP_DIR}
+mkdir ${TEMP_DIR}
+
+RUN=1
+while [[ ${RUN} -le ${RESTARTS} ]]; do
+    echo "run ${RUN}: sending ${COUNTS} messages"
+    run_once ${RUN}
+    RUN=$((RUN+1))
+done
+
+# one more start, which recovers the last run's segment, to replay it all
+start_server
+timeout 2 stdbuf -oL \
+    ./receiver -n $((RESTARTS * COUNTS)) localhost ${PORT} eva ${ROOM} \
+        1> "restart.out" \
+        2> "restart.err"
+cleanup
+
+echo "verifying outputs"
+RESULT=0
+SEGMENTS=$(ls ${LOG_DIR}/${ROOM}/*.seg | wc -l)
+BYTES=$(cat ${LOG_DIR}/${ROOM}/*.seg | wc -c)
+if [[ ${SEGMENTS} -ne ${RESTARTS} ]]; then
+    echo "expected ${RESTARTS} segments but found ${SEGMENTS}"
+    RESULT=1
+elif [[ ${BYTES} -ge ${RETAIN_BYTES} ]]; then
+    echo "segments hold ${BYTES} bytes, over the ${RETAIN_BYTES} byte limit"
+    RESULT=1
+else
+    verify restart.out
+    RESULT=$?
+fi
+rm -rf ${TEMP_DIR}
+
+if [[ ${RESULT} -eq 0 ]]; then
+    echo "Tests passed successfully!"
+fi
+
+# exit with correct code
+exit ${RESULT}
@@ -0,0 +1,133 @@
+#include <ctime>
+#include "guard.h"
+#include "worker_pool.h"
+
+namespace {
+    // Current time on the monotonic clock, in nanoseconds
+    uint64_t now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+    }
+}
+
+// WorkerPool constructor
+WorkerPool::WorkerPool(int num_workers, int capacity, SessionFunc func)
+  : m_num_workers(num_workers)
+  , m_func(func)
+  , m_jobs(capacity)
+  , m_front(0)
+  , m_count(0)
+  , m_accepted(0)
+  , m_rejected(0)
+  , m_started(0)
+  , m_total_wait_ns(0)
+  , m_max_wait_ns(0) {
+    pthread_mutex_init(&m_lock, nullptr);
+    // Initially every slot is free and there are no jobs
+    sem_init(&m_slots, 0, capacity);
+    sem_init(&m_items, 0, 0);
+}
+
+// WorkerPool destructor (workers run forever, so the pool is only
+// destroyed when the server process is shutting down)
+WorkerPool::~WorkerPool() {
+    pthread_mutex_destroy(&m_lock);
+    sem_destroy(&m_slots);
+    sem_destroy(&m_items);
+}
+
+// Spawn the worker threads
+bool WorkerPool::start() {
+    for (int i = 0; i < m_num_workers; i++) {
+        pthread_t thr_id;
+        if (pthread_create(&thr_id, nullptr, run, this) != 0) {
+            return false;
+        }
+        pthread_detach(thr_id);
+    }
+    return true;
+}
+
+// Queue a client, blocking while the queue is full. Since the accept
+// loop is the caller, further connections wait in the listen backlog.
+void WorkerPool::submit(ClientInfo *client) {
+    while (sem_wait(&m_slots) != 0) {
+        // retry if interrupted by a signal
+    }
+    insert(client);
+}
+
+// Queue a client only if a slot is free
+bool WorkerPool::try_submit(ClientInfo *client) {
+    if (sem_trywait(&m_slots) != 0) {
+        Guard guard(m_lock);
+        m_rejected++;
+        return false;
+    }
+    insert(client);
+    return true;
+}
+
+// Return a snapshot of the counters
+WorkerPool::Stats WorkerPool::get_stats() const {
+    Guard guard(m_lock);
+    Stats stats;
+    stats.accepted = m_accepted;
+    stats.rejected = m_rejected;
+    stats.started = m_started;
+    stats.total_wait_ns = m_total_wait_ns;
+    stats.max_wait_ns = m_max_wait_ns;
+    stats.queued = m_count;
+    return stats;
+}
+
+// Worker thread: take clients from the queue and run their sessions
+void *WorkerPool::run(void *arg) {
+    WorkerPool *pool = static_cast<WorkerPool *>(arg);
+    while (true) {
+        Job job = pool->remove();
+        pool->m_func(job.client);
+    }
+    return nullptr;
+}
+
+// Put a client in a slot that the caller has already claimed
+void WorkerPool::insert(ClientInfo *client) {
+    {
+        Guard guard(m_lock);
+        Job &job = m_jobs[(m_front + m_count) % m_jobs.size()];
+        job.client = client;
+        job.enqueue_ns = now_ns();
+        m_count++;
+        m_accepted++;
+    }
+    // Announce the new job
+    sem_post(&m_items);
+}
+
+// Wait for a job and take it out of the queue
+WorkerPool::Job WorkerPool::remove() {
+    while (sem_wait(&m_items) != 0) {
+        // retry if interrupted by a signal
+    }
+
+    Job job;
+    {
+        Guard guard(m_lock);
+        job = m_jobs[m_front];
+        m_front = (m_front + 1) % m_jobs.size();
+        m_count--;
+
+        // Account for how long the client waited for a worker
+        uint64_t wait_ns = now_ns() - job.enqueue_ns;
+        m_started++;
+        m_total_wait_ns += wait_ns;
+        if (wait_ns > m_max_wait_ns) {
+            m_max_wait_ns = wait_ns;
+        }
+    }
+    // Announce the free slot
+    sem_post(&m_slots);
+    return job;
+}
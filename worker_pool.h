@@ -0,0 +1,73 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <vector>
+#include <cstdint>
+#include <pthread.h>
+#include <semaphore.h>
+struct ClientInfo;
+
+// A fixed set of pre-spawned worker threads that service clients taken
+// from a bounded queue (the classic semaphore-based bounded buffer).
+// Each worker runs one client session at a time, so the number of
+// threads never grows with the number of connections.
+class WorkerPool {
+public:
+  // function run by a worker for each client it takes from the queue
+  typedef void (*SessionFunc)(ClientInfo *client);
+
+  // snapshot of the pool's counters
+  struct Stats {
+    uint64_t accepted;      // clients placed in the queue
+    uint64_t rejected;      // clients turned away because the queue was full
+    uint64_t started;       // clients taken from the queue by a worker
+    uint64_t total_wait_ns; // sum of the time clients spent in the queue
+    uint64_t max_wait_ns;   // longest time a client spent in the queue
+    unsigned queued;        // clients currently waiting in the queue
+  };
+
+  WorkerPool(int num_workers, int capacity, SessionFunc func);
+  ~WorkerPool();
+
+  // Spawn the worker threads
+  bool start();
+
+  // Add a client to the queue, waiting for room if it is full
+  void submit(ClientInfo *client);
+
+  // Add a client to the queue only if there is room right now
+  bool try_submit(ClientInfo *client);
+
+  Stats get_stats() const;
+
+private:
+  // prohibit value semantics
+  WorkerPool(const WorkerPool &);
+  WorkerPool &operator=(const WorkerPool &);
+
+  // a queued client and when it was queued
+  struct Job {
+    ClientInfo *client;
+    uint64_t enqueue_ns;
+  };
+
+  static void *run(void *arg);
+  void insert(ClientInfo *client);
+  Job remove();
+
+  int m_num_workers;
+  SessionFunc m_func;
+
+  // circular buffer of jobs, protected by m_lock
+  std::vector<Job> m_jobs;
+  unsigned m_front, m_count;
+  mutable pthread_mutex_t m_lock;
+  sem_t m_slots; // number of free slots in the buffer
+  sem_t m_items; // number of queued jobs
+
+  // counters, protected by m_lock
+  uint64_t m_accepted, m_rejected, m_started;
+  uint64_t m_total_wait_ns, m_max_wait_ns;
+};
+
+#endif // WORKER_POOL_H